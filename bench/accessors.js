@@ -0,0 +1,60 @@
+/*
+ * Microbenchmark of per-call overhead of the hottest accessors.
+ *
+ * Usage: node bench/accessors.js [module] [iterations]
+ *
+ * module - path to the binding to measure (default: this package),
+ *          e. g. a build of another revision to compare with.
+ *
+ * Trees are built in memory, no files are loaded, so the numbers are
+ * dominated by the binding layer rather than by augeas itself.
+ * 'error' (no arguments, no tree access) shows the floor of the call cost.
+ */
+
+var path = require('path');
+
+var binding = process.argv[2] ? path.resolve(process.argv[2]) : '..';
+var iterations = parseInt(process.argv[3] || '1000000', 10);
+
+var libaugeas = require(binding);
+
+var aug = libaugeas.createAugeas({
+    flags: libaugeas.AUG_NO_LOAD | libaugeas.AUG_NO_MODL_AUTOLOAD
+});
+
+var N = 100;
+for (var i = 1; i <= N; ++i) {
+    aug.set('/bench/node[' + i + ']', 'value' + i);
+}
+aug.set('/bench/long', new Array(1024).join('x'));
+
+function measure(name, fn) {
+    // warm up:
+    for (var i = 0; i < 10000; ++i) {
+        fn(i);
+    }
+    var start = process.hrtime.bigint();
+    for (var i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    var ns = Number(process.hrtime.bigint() - start) / iterations;
+    return { name: name, ns: ns };
+}
+
+var results = [
+    measure('error', function() { aug.error(); }),
+    measure('get', function() { aug.get('/bench/node[7]'); }),
+    measure('get (1K value)', function() { aug.get('/bench/long'); }),
+    measure('nmatch', function() { aug.nmatch('/bench/node[7]'); }),
+    measure('set', function(i) { aug.set('/bench/node[7]', 'v' + (i & 7)); })
+];
+
+var floor = results[0].ns;
+console.log('module: ' + require.resolve(binding));
+console.log('iterations: ' + iterations);
+results.forEach(function(r) {
+    console.log((r.name + ':                ').substr(0, 16) +
+                r.ns.toFixed(1) + ' ns/call' +
+                (r === results[0] ? '' :
+                 ' (+' + (r.ns - floor).toFixed(1) + ' ns over error)'));
+});
@@ -0,0 +1,333 @@
+/*
+ * End-to-end scaling and soak benchmark.
+ *
+ * Usage: node bench/soak.js [options]
+ *
+ * --module PATH     binding to measure (default: this package)
+ * --threads LIST    UV_THREADPOOL_SIZE values (default: 1,4,16)
+ * --handles LIST    numbers of concurrent handles (default: 1,8,32)
+ * --files LIST      numbers of files per tree (default: 10,100)
+ * --lines N         lines per file (default: 50)
+ * --duration SEC    time per configuration (default: 30)
+ * --sample SEC      interval of RSS samples (default: 1)
+ * --out FILE        JSON report (default: soak-report.json)
+ *
+ * Every combination of threads x handles x files runs in a child process
+ * with its own UV_THREADPOOL_SIZE. Each handle is driven by a worker
+ * doing a mix of async createAugeas() (replacing the handle), set + async
+ * save(), match() and srun() on a tree of generated hosts files in a
+ * temporary root. For every operation the report has throughput and
+ * latency percentiles, for every operation on the threadpool (as reported
+ * by setTracer()) percentiles of time waiting in the queue and running,
+ * and for every configuration RSS and external memory sampled over time.
+ * The report has no timestamps, host names or absolute paths, so reports
+ * of two builds can be compared with diff.
+ *
+ * For hours of churn use e. g. --threads 4 --handles 32 --duration 7200.
+ */
+
+var child_process = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+
+// operation: weight
+var MIX = { create: 1, save: 4, match: 10, srun: 5 };
+
+function parseArgs(argv) {
+    var opts = {
+        module: '..',
+        threads: [1, 4, 16],
+        handles: [1, 8, 32],
+        files: [10, 100],
+        lines: 50,
+        duration: 30,
+        sample: 1,
+        out: 'soak-report.json'
+    };
+    for (var i = 0; i < argv.length; i += 2) {
+        var name = argv[i].replace(/^--/, '');
+        var value = argv[i + 1];
+        if (!(name in opts) || undefined === value) {
+            throw new Error('Bad option: ' + argv[i]);
+        }
+        if (Array.isArray(opts[name])) {
+            opts[name] = value.split(',').map(Number);
+        } else if ('number' === typeof opts[name]) {
+            opts[name] = Number(value);
+        } else {
+            opts[name] = value;
+        }
+    }
+    if ('..' !== opts.module) {
+        opts.module = path.resolve(opts.module);
+    }
+    return opts;
+}
+
+function percentile(sorted, p) {
+    if (0 === sorted.length) {
+        return 0;
+    }
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function round(x) {
+    return Math.round(x * 1000) / 1000;
+}
+
+/*
+ * Child: runs one configuration and sends the result to the parent.
+ */
+function child(cfg) {
+    var libaugeas = require(cfg.module);
+
+    var root = fs.mkdtempSync(path.join(os.tmpdir(), 'augeas-soak-'));
+    fs.mkdirSync(path.join(root, 'etc', 'soak'), { recursive: true });
+    for (var f = 0; f < cfg.files; ++f) {
+        var text = '';
+        for (var l = 0; l < cfg.lines; ++l) {
+            text += '10.' + (f & 255) + '.' + (l >> 8) + '.' + (l & 255) +
+                    ' host' + f + '-' + l + ' alias' + l + '\n';
+        }
+        fs.writeFileSync(path.join(root, 'etc', 'soak', f + '.hosts'), text);
+    }
+
+    var options = {
+        root: root,
+        flags: libaugeas.AUG_NO_MODL_AUTOLOAD,
+        lens: 'hosts',
+        incl: '/etc/soak/*.hosts'
+    };
+
+    var latency = {};
+    Object.keys(MIX).forEach(function(op) {
+        latency[op] = [];
+    });
+    var errors = 0;
+    var total = 0;
+    // threadpool spans by name:
+    var queue = {};
+    var run = {};
+    libaugeas.setTracer(function(spans) {
+        spans.forEach(function(span) {
+            if (undefined === span.queue) {
+                return;
+            }
+            if (!(span.name in queue)) {
+                queue[span.name] = [];
+                run[span.name] = [];
+            }
+            queue[span.name].push(span.queue);
+            run[span.name].push(span.run);
+        });
+    });
+    var ops = [];
+    Object.keys(MIX).forEach(function(op) {
+        for (var i = 0; i < MIX[op]; ++i) {
+            ops.push(op);
+        }
+    });
+
+    var start = Date.now();
+    var deadline = start + cfg.duration * 1000;
+    var samples = [];
+    var sampler = setInterval(function() {
+        var mem = process.memoryUsage();
+        samples.push({
+            t: round((Date.now() - start) / 1000),
+            rss: mem.rss,
+            heapUsed: mem.heapUsed,
+            external: mem.external,
+            ops: total
+        });
+    }, cfg.sample * 1000);
+
+    function done(op, t0) {
+        latency[op].push(Number(process.hrtime.bigint() - t0) / 1e6);
+        ++total;
+    }
+
+    function worker(id, aug, n, finish) {
+        if (Date.now() >= deadline) {
+            aug.close();
+            return finish();
+        }
+        var next = function() {
+            setImmediate(worker, id, aug, n + 1, finish);
+        };
+        var op = ops[Math.floor(Math.random() * ops.length)];
+        var file = '/files/etc/soak/' +
+                   Math.floor(Math.random() * cfg.files) + '.hosts';
+        var t0 = process.hrtime.bigint();
+
+        try {
+            if ('create' === op) {
+                libaugeas.createAugeas(options, function(fresh) {
+                    done(op, t0);
+                    aug.close();
+                    aug = fresh;
+                    next();
+                });
+                return;
+            }
+            if ('save' === op) {
+                aug.set(file + '/1/canonical', 'w' + id + '-' + n);
+                aug.save(function(rc) {
+                    if (0 !== rc) {
+                        ++errors;
+                    }
+                    done(op, t0);
+                    next();
+                });
+                return;
+            }
+            if ('match' === op) {
+                aug.match('/files/etc/soak/*/*[alias = "alias' +
+                          (n % cfg.lines) + '"]/ipaddr');
+            } else { // srun
+                aug.srun([
+                    'set ' + file + '/01/ipaddr 192.168.' + (id & 255) + '.1',
+                    'set ' + file + '/01/canonical soak' + id,
+                    'rm ' + file + '/01'
+                ]);
+            }
+            done(op, t0);
+        } catch (e) {
+            ++errors;
+        }
+        next();
+    }
+
+    var running = cfg.handles;
+    function finish() {
+        if (--running > 0) {
+            return;
+        }
+        clearInterval(sampler);
+        libaugeas.setTracer(null);
+        fs.rmSync(root, { recursive: true, force: true });
+
+        var elapsed = (Date.now() - start) / 1000;
+        var result = {
+            ops: {},
+            threadpool: {},
+            errors: errors,
+            samples: samples
+        };
+        Object.keys(latency).forEach(function(op) {
+            var l = latency[op].sort(function(a, b) { return a - b; });
+            result.ops[op] = {
+                count: l.length,
+                perSec: round(l.length / elapsed),
+                p50: round(percentile(l, 0.5)),
+                p99: round(percentile(l, 0.99)),
+                max: round(percentile(l, 1))
+            };
+        });
+        Object.keys(queue).sort().forEach(function(name) {
+            var q = queue[name].sort(function(a, b) { return a - b; });
+            var r = run[name].sort(function(a, b) { return a - b; });
+            result.threadpool[name] = {
+                count: q.length,
+                queueP50: round(percentile(q, 0.5)),
+                queueP99: round(percentile(q, 0.99)),
+                runP50: round(percentile(r, 0.5)),
+                runP99: round(percentile(r, 0.99))
+            };
+        });
+        result.perSec = round(total / elapsed);
+        var rss = samples.map(function(s) { return s.rss; });
+        result.rss = rss.length === 0 ? {} : {
+            first: rss[0],
+            last: rss[rss.length - 1],
+            max: Math.max.apply(null, rss)
+        };
+        process.send(result, function() {
+            process.disconnect();
+        });
+    }
+
+    function startWorker(id) {
+        libaugeas.createAugeas(options, function(aug) {
+            worker(id, aug, 0, finish);
+        });
+    }
+    for (var h = 0; h < cfg.handles; ++h) {
+        startWorker(h);
+    }
+}
+
+/*
+ * Parent: runs every configuration in a child process.
+ */
+function parent(opts) {
+    var configs = [];
+    opts.threads.forEach(function(threads) {
+        opts.handles.forEach(function(handles) {
+            opts.files.forEach(function(files) {
+                configs.push({
+                    module: opts.module,
+                    threads: threads,
+                    handles: handles,
+                    files: files,
+                    lines: opts.lines,
+                    duration: opts.duration,
+                    sample: opts.sample
+                });
+            });
+        });
+    });
+
+    var report = {
+        // relative to the repository, so reports of checkouts compare:
+        module: path.relative(path.join(__dirname, '..'),
+                              require.resolve(opts.module)),
+        node: process.version,
+        mix: MIX,
+        results: []
+    };
+
+    (function run(i) {
+        if (i === configs.length) {
+            fs.writeFileSync(opts.out, JSON.stringify(report, null, 2) + '\n');
+            console.log('Report: ' + opts.out);
+            return;
+        }
+        var cfg = configs[i];
+        var env = Object.assign({}, process.env,
+                                { UV_THREADPOOL_SIZE: String(cfg.threads) });
+        var proc = child_process.fork(__filename,
+                                      ['--child', JSON.stringify(cfg)],
+                                      { env: env });
+        proc.on('message', function(result) {
+            var save = result.threadpool.save || { queueP99: 0, runP99: 0 };
+            report.results.push(Object.assign({
+                threads: cfg.threads,
+                handles: cfg.handles,
+                files: cfg.files,
+                lines: cfg.lines
+            }, result));
+            console.log('threads=' + cfg.threads + ' handles=' + cfg.handles +
+                        ' files=' + cfg.files + ': ' + result.perSec +
+                        ' ops/s, save p99 ' + result.ops.save.p99 +
+                        ' ms (queue ' + save.queueP99 + ', run ' +
+                        save.runP99 + '), create p99 ' +
+                        result.ops.create.p99 +
+                        ' ms, rss ' + Math.round(result.rss.last / 1048576) +
+                        ' MB, errors ' + result.errors);
+        });
+        proc.on('exit', function(code) {
+            if (0 !== code) {
+                console.log('Configuration failed: ' + JSON.stringify(cfg));
+            }
+            run(i + 1);
+        });
+    })(0);
+}
+
+if ('--child' === process.argv[2]) {
+    child(JSON.parse(process.argv[3]));
+} else {
+    parent(parseArgs(process.argv.slice(2)));
+}
@@ -5,6 +5,10 @@
       'libraries': [
 	'-laugeas'
       ],
+      'defines': [
+        # checked in libaugeas.cc:
+        "AUGEAS_VERSION=<!(pkg-config --modversion augeas | awk -F. '{ print $1 * 10000 + $2 * 100 + $3 }')"
+      ],
       'conditions': [
         ['OS=="mac"', {
             'include_dirs': [
@@ -0,0 +1,23 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+// How many sshd configs permit root login:
+console.log(aug.aggregate('/files/etc/ssh/sshd_config/PermitRootLogin'));
+
+// Distinct labels of host entries:
+console.log(aug.aggregate('/files/etc/hosts/*/*', { op: 'distinct', groupBy: 'label' }));
+
+// Hosts by canonical name, on the threadpool:
+aug.aggregate('/files/etc/hosts/*', { groupBy: 'canonical', op: 'list' },
+    function(rc, groups) {
+        console.log(rc, groups);
+    });
+
+/* Example output:
+[ { key: 'no', count: 1 } ]
+[ 'alias', 'canonical', 'ipaddr' ]
+0 [ { key: 'localhost', paths: [ '/files/etc/hosts/1' ] },
+    { key: 'localhost6', paths: [ '/files/etc/hosts/2' ] } ]
+*/
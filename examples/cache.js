@@ -0,0 +1,20 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+aug.cache(true);
+
+for (var i = 0; i < 1000; ++i) {
+    aug.get('/files/etc/hosts/1/ipaddr');
+    aug.match('/files/etc/fstab/*[file = "/"]/spec');
+}
+
+// Forgets only results under /files/etc/hosts:
+aug.set('/files/etc/hosts/1/ipaddr', '127.0.0.2');
+console.log(aug.get('/files/etc/hosts/1/ipaddr'));
+console.log(aug.cacheStats());
+
+/* Example output:
+127.0.0.2
+{ hits: 1998, misses: 3, size: 2 }
+*/
@@ -0,0 +1,23 @@
+
+var libaugeas = require('..');
+
+// Each handle holds a whole tree, close it when done
+// instead of waiting for garbage collection:
+for (var i = 0; i < 100; ++i) {
+    var aug = libaugeas.createAugeas();
+    console.log(aug.get('/files/etc/hosts/1/ipaddr'));
+    aug.close();
+}
+
+try {
+    aug.get('/files/etc/hosts/1/ipaddr');
+} catch (e) {
+    console.log(e.message);
+}
+
+/* Example output:
+127.0.0.1
+...
+127.0.0.1
+Augeas handle is closed
+*/
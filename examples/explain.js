@@ -0,0 +1,25 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+var res = aug.explain('/files/etc//ipaddr[. = "127.0.0.1"]/../canonical');
+
+console.log(res.count + ' nodes in ' + res.ms.toFixed(3) + ' ms');
+res.steps.forEach(function(s) {
+    console.log(s.delta.toFixed(3) + ' ms\t' + s.count + '\t' + s.step);
+});
+res.warnings.forEach(function(w) {
+    console.log('Warning: ' + w);
+});
+
+/* Example output:
+1 nodes in 41.207 ms
+0.004 ms	1	/files
+0.003 ms	1	/etc
+39.816 ms	18	//ipaddr
+1.090 ms	1	[. = "127.0.0.1"]
+0.003 ms	1	/..
+0.004 ms	1	/canonical
+Warning: Step '//ipaddr' scans all descendants of 1 nodes
+*/
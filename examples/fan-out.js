@@ -0,0 +1,25 @@
+
+var libaugeas = require('..');
+
+var roots = [];
+for (var i = 1; i <= 100; ++i) {
+    roots.push('/srv/containers/' + i + '/rootfs');
+}
+
+libaugeas.fanOut(roots, {
+    flags: libaugeas.AUG_NO_MODL_AUTOLOAD,
+    lens: 'hosts',
+    incl: '/etc/hosts',
+    script: [
+        'set /files/etc/hosts/01/ipaddr 192.168.0.1',
+        'set /files/etc/hosts/01/canonical gateway'
+    ],
+    concurrency: 8
+}, function(results) {
+    results.forEach(function(r) {
+        if (r.rc < 0) {
+            console.log(r.root + ': ' + r.error);
+        }
+    });
+    console.log('Done: ' + results.length + ' roots');
+});
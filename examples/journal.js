@@ -0,0 +1,37 @@
+
+var libaugeas = require('..');
+
+var opts = {
+    flags: libaugeas.AUG_NO_MODL_AUTOLOAD,
+    lens: 'hosts',
+    incl: '/etc/hosts'
+};
+
+// Record changes once:
+var aug = libaugeas.createAugeas();
+aug.journalStart();
+aug.set('/files/etc/hosts/1/alias[last()+1]', 'myhost');
+aug.rm('/files/etc/hosts/2');
+var journal = aug.journalStop();
+console.log('Journal: ' + journal.length + ' bytes');
+
+// Apply them to other roots with one call per root:
+['/srv/chroot1', '/srv/chroot2'].forEach(function(root) {
+    opts.root = root;
+    libaugeas.createAugeas(opts, function(target) {
+        target.replay(journal, function(rc) {
+            if (rc < 0) {
+                console.log(root + ': ' + target.errorMsg());
+            } else {
+                target.save();
+                console.log(root + ': ' + rc + ' operations');
+            }
+        });
+    });
+});
+
+/* Example output:
+Journal: 89 bytes
+/srv/chroot1: 2 operations
+/srv/chroot2: 2 operations
+*/
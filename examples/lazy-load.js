@@ -0,0 +1,16 @@
+
+var libaugeas = require('..');
+
+// Files are only enumerated here:
+var aug = libaugeas.createAugeas({lazy: true});
+
+// /etc/hosts is parsed now:
+console.log(aug.get('/files/etc/hosts/1/ipaddr'));
+
+// All files under /etc/ssh are parsed now:
+console.log(aug.match('/files/etc/ssh/*/PermitRootLogin'));
+
+/* Example output:
+127.0.0.1
+[ '/files/etc/ssh/sshd_config/PermitRootLogin' ]
+*/
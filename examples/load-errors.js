@@ -0,0 +1,20 @@
+
+var libaugeas = require('..');
+
+// Some files are not readable if running unprivileged:
+var aug = libaugeas.createAugeas();
+
+// All load errors in one call:
+aug.loadErrors().forEach(function(e) {
+    console.log((e.file || e.path) +
+                (e.line ? ':' + e.line : '') +
+                (e.char ? ':' + e.char : '') +
+                ': ' + (e.message || e.error) +
+                (e.lens ? ' (' + e.lens + ')' : ''));
+});
+
+/* Example output:
+/etc/mke2fs.conf:3:0: Get did not match entire input (@Mke2fs)
+/etc/securetty: Permission denied (@Securetty)
+/etc/sudoers: Permission denied (@Sudoers)
+*/
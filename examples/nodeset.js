@@ -0,0 +1,22 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+var hosts = aug.nodeset('/files/etc/hosts/*/*');
+console.log(hosts.count());
+console.log(hosts.get(0), hosts.path(0));
+
+for (var node of hosts) {
+    if (node.label === 'alias') {
+        console.log(node.label + '[' + node.index + '] = ' + node.value);
+    }
+}
+hosts.free();
+
+/* Example output:
+6
+{ label: 'ipaddr', value: '127.0.0.1', index: 1 } /files/etc/hosts/1/ipaddr
+alias[1] = localhost.localdomain
+alias[2] = localhost4
+*/
@@ -0,0 +1,20 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas({flags: libaugeas.AUG_NO_LOAD});
+
+// e. g. fetched from a database:
+var text = '127.0.0.1 localhost\n192.168.0.1 gateway gw\n';
+
+aug.parseText('Hosts.lns', text, '/parsed/hosts');
+console.log(aug.match('/parsed/hosts/*/canonical'));
+
+// Large inputs can be parsed on the threadpool:
+aug.parseText('Hosts.lns', Buffer.from(text), '/parsed/hosts2', function(rc) {
+    console.log(rc ? aug.loadErrors() : aug.get('/parsed/hosts2/2/alias'));
+});
+
+/* Example output:
+[ '/parsed/hosts/1/canonical', '/parsed/hosts/2/canonical' ]
+gw
+*/
@@ -0,0 +1,23 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+aug.set('/files/etc/hosts/1/alias[last()+1]', 'myhost');
+
+// What would be written to /etc/hosts:
+process.stdout.write(aug.preview('/files/etc/hosts'));
+
+// Render a tree built in memory:
+aug.set('/generated/hosts/1/ipaddr', '10.0.0.1');
+aug.set('/generated/hosts/1/canonical', 'node1');
+aug.renderText('Hosts.lns', ['/generated/hosts'], function(rc, texts) {
+    if (rc === 0) {
+        process.stdout.write(texts[0]);
+    }
+});
+
+/* Example output:
+127.0.0.1 localhost myhost
+10.0.0.1	node1
+*/
@@ -0,0 +1,29 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+// Read-only replica is kept in sync with aug on the threadpool:
+aug.replica(function(replica) {
+    aug.set('/files/etc/hosts/1/canonical', 'myhost');
+
+    // The primary may be busy saving, reading from the replica is safe:
+    aug.save(function(rc) {
+        console.log('Saved: ' + rc);
+    });
+    console.log(replica.match('/files/etc/hosts/*/canonical'));
+
+    // Modifications of the replica are not allowed:
+    try {
+        replica.rm('/files/etc/hosts/1');
+    } catch (e) {
+        console.log(e.message);
+    }
+});
+
+/* Example output:
+[ '/files/etc/hosts/1/canonical',
+  '/files/etc/hosts/2/canonical' ]
+Augeas replica is read-only
+Saved: 0
+*/
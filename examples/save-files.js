@@ -0,0 +1,16 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+aug.set('/files/etc/hosts/1/canonical', 'myhost');
+aug.set('/files/etc/fstab/1/opt', 'noatime');
+
+// Only /etc/hosts is written, /etc/fstab stays modified in the tree:
+aug.saveFiles(['/files/etc/hosts'], function(rc, results) {
+    console.log(rc, results);
+});
+
+/* Example output:
+0 [ { path: '/files/etc/hosts', saved: true } ]
+*/
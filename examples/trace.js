@@ -0,0 +1,28 @@
+
+var PerformanceObserver = require('perf_hooks').PerformanceObserver;
+var libaugeas = require('..');
+
+new PerformanceObserver(function(list) {
+    list.getEntries().forEach(function(e) {
+        console.log(e.name, e.duration.toFixed(3), e.detail.path || '');
+    });
+}).observe({ entryTypes: ['measure'] });
+
+libaugeas.traceEvents();
+
+libaugeas.createAugeas({ lens: 'hosts', incl: '/etc/hosts' }, function(aug) {
+    aug.get('/files/etc/hosts/1/ipaddr');
+    aug.set('/files/etc/hosts/1/canonical', 'myhost');
+    aug.save(function(rc) {
+        console.log('Saved: ' + rc);
+        libaugeas.traceEvents(false);
+    });
+});
+
+/* Example output:
+augeas.createAugeas 3.418 
+augeas.get 0.012 /files/etc/hosts/1/ipaddr
+augeas.set 0.009 /files/etc/hosts/1/canonical
+Saved: 0
+augeas.save 1.204
+*/
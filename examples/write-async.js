@@ -0,0 +1,23 @@
+
+var libaugeas = require('..');
+
+var aug = libaugeas.createAugeas();
+
+async function addHost(n) {
+    await aug.setAsync('/files/etc/hosts/0' + n + '/ipaddr', '192.168.0.' + n);
+    await aug.setAsync('/files/etc/hosts/0' + n + '/canonical', 'node' + n);
+}
+
+// Writes made while a job is running go to the threadpool in the next job:
+Promise.all([addHost(1), addHost(2), addHost(3), aug.rmAsync('/files/etc/hosts/9')])
+    .then(function(rcs) {
+        console.log(rcs);
+        aug.save(function(rc) {
+            console.log('Saved: ' + rc);
+        });
+    });
+
+/* Example output:
+[ undefined, undefined, undefined, 0 ]
+Saved: 0
+*/
@@ -16,4 +16,122 @@ try {
         libaugeas = require('./augeas');
 }
 
+// aug.close() with 'using aug = libaugeas.createAugeas()'. Without
+// Symbol.dispose, Symbol.for('nodejs.dispose') is used, as Node itself
+// did before it: 'using' needs runtime support anyway, and older
+// runtimes can call aug[Symbol.for('nodejs.dispose')]() or aug.close():
+var dispose = (typeof Symbol.dispose === 'symbol') ?
+        Symbol.dispose : Symbol.for('nodejs.dispose');
+libaugeas.Augeas.prototype[dispose] = function() {
+        this.close();
+};
+
+// for (var node of aug.nodeset('/files/etc/hosts/*')) {...}
+libaugeas.Nodeset.prototype[Symbol.iterator] = function*() {
+        for (var i = 0; i < this.count(); ++i) {
+                yield this.get(i);
+        }
+};
+
+/*
+ * Promise API for writes, see writeBatch(). set, rm and mv calls made
+ * on a handle in the same tick are sent as one batch at the end of the
+ * tick, and each promise is settled with its own result:
+ *
+ * await Promise.all([aug.setAsync(path1, 'a'), aug.rmAsync(path2)]);
+ *
+ * Writes are applied in the order of calls. Other functions called
+ * after the tick wait for the writes, e. g. a get() in a later tick
+ * sees them. Functions called in the same tick run before them.
+ */
+var pendingWrites = new WeakMap(); // by handle: [{ op, resolve, reject }]
+
+function flushWrites(aug) {
+        var writes = pendingWrites.get(aug);
+        pendingWrites.delete(aug);
+        try {
+                aug.writeBatch(writes.map(function(w) {
+                        return w.op;
+                }), function(results) {
+                        writes.forEach(function(w, i) {
+                                if (results[i].rc < 0) {
+                                        w.reject(new Error(results[i].error));
+                                } else {
+                                        w.resolve(results[i].rc);
+                                }
+                        });
+                });
+        } catch (e) {
+                writes.forEach(function(w) {
+                        w.reject(e);
+                });
+        }
+}
+
+function queueWrite(aug, op) {
+        return new Promise(function(resolve, reject) {
+                var writes = pendingWrites.get(aug);
+                if (undefined === writes) {
+                        writes = [];
+                        pendingWrites.set(aug, writes);
+                        process.nextTick(flushWrites, aug);
+                }
+                writes.push({ op: op, resolve: resolve, reject: reject });
+        });
+}
+
+libaugeas.Augeas.prototype.setAsync = function(path, value) {
+        return queueWrite(this, ['set', path, value]);
+};
+
+libaugeas.Augeas.prototype.rmAsync = function(path) {
+        return queueWrite(this, ['rm', path]);
+};
+
+libaugeas.Augeas.prototype.mvAsync = function(src, dst) {
+        return queueWrite(this, ['mv', src, dst]);
+};
+
+/*
+ * Reports augeas operations as User Timing measures 'augeas.<name>'
+ * (e. g. 'augeas.save'), so they can be observed with PerformanceObserver
+ * or recorded by 'node --trace-event-categories node.perf.usertiming'.
+ * The span (see setTracer()) is passed as 'detail'.
+ * These measures are cleared right away to keep the timeline buffer small,
+ * other measures are left alone.
+ *
+ * traceEvents(false) disables tracing.
+ */
+libaugeas.traceEvents = function(enable) {
+        if (enable === false) {
+                libaugeas.setTracer(null);
+                return;
+        }
+
+        var perf = require('perf_hooks').performance;
+        // spans are timed with process.hrtime(), measures with performance.now():
+        var offset = perf.now() - Number(process.hrtime.bigint()) / 1e6;
+
+        libaugeas.setTracer(function(spans) {
+                var names = {};
+                spans.forEach(function(span) {
+                        var name = 'augeas.' + span.name;
+                        perf.measure(name, {
+                                start: span.start + offset,
+                                duration: span.duration,
+                                detail: span
+                        });
+                        names[name] = true;
+                });
+                Object.keys(names).forEach(function(name) {
+                        perf.clearMeasures(name);
+                });
+        });
+};
+
+// spans buffered when the process exits, see flushTraces():
+process.on('exit', function() {
+        libaugeas.flushTraces();
+});
+
 module.exports = libaugeas;
@@ -9,7 +9,23 @@
  * http://www.opensource.org/licenses/CDDL-1.0
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
 #define BUILDING_NODE_EXTENSION 1
 
@@ -21,6 +37,11 @@ extern "C" { // Yes, that bad
 #include <augeas.h>
 }
 
+// 10000 * major + 100 * minor + patch, defined by binding.gyp:
+#if defined(AUGEAS_VERSION) && AUGEAS_VERSION < 11300
+#error "augeas >= 1.13.0 is required (aug_preview(), aug_load_file())"
+#endif
+
 using namespace v8;
 template<class T>
 using Handle = v8::Local<T>;
@@ -86,6 +107,43 @@ inline uint32_t memberToUint32(Handle<Object> obj, const char *key) {
     }
 }
 
+/*
+ * Helper function.
+ * Converts value of object member *key into bool.
+ * Returns false if memder does not exist.
+ */
+inline bool memberToBool(Handle<Object> obj, const char *key) {
+    Local<Value> m = obj->Get(ctx(), Nan::New<String>(key).ToLocalChecked()).ToLocalChecked();
+    return m->BooleanValue(isol());
+}
+
+/*
+ * Helper function.
+ * Frees the array returned by aug_match().
+ */
+inline void free_matches(char **matches, int n) {
+    if (NULL != matches) {
+        for (int i = 0; i < n; ++i) {
+            free(matches[i]);
+        }
+        free(matches);
+    }
+}
+
+/*
+ * Helper function.
+ * Returns the last step of a path without the position predicate,
+ * e. g. "message" for "/augeas/files/etc/hosts/error/message[2]".
+ */
+inline std::string path_label(const std::string &path) {
+    std::string label = path.substr(path.rfind('/') + 1);
+    size_t bracket = label.find('[');
+    if (bracket != std::string::npos) {
+        label.erase(bracket);
+    }
+    return label;
+}
+
 /*
  * Helper function.
  * Joins JS array by new line.
@@ -105,795 +163,5524 @@ inline std::string join(Local<Array> a) {
     return res;
 }
 
-class LibAugeas : public node::ObjectWrap {
+/*
+ * Helper class.
+ * Converts JS argument into C string like String::Utf8Value,
+ * but without allocating memory for short strings (most paths and values).
+ * Used by the hottest accessors (get, nmatch, set).
+ */
+class Utf8Arg {
   public:
-    static void Init(Handle<Object> target);
-    static Local<Object> New(augeas *aug);
+    Utf8Arg(v8::Isolate *isolate, Local<Value> value) : m_str(m_buf) {
+        Local<String> str;
+        if (!value->ToString(isolate->GetCurrentContext()).ToLocal(&str)) {
+            m_buf[0] = '\0';
+            return;
+        }
+        int len = str->Utf8Length(isolate);
+        if (len >= static_cast<int>(sizeof(m_buf))) {
+            m_heap.resize(len + 1);
+            m_str = &m_heap[0];
+        }
+        str->WriteUtf8(isolate, m_str, len + 1);
+    }
 
-  protected:
-    augeas *m_aug;
-    LibAugeas();
-    ~LibAugeas();
+    const char *operator*() const { return m_str; }
 
-    static Nan::Persistent<FunctionTemplate> augeasTemplate;
-    static Nan::Persistent<Function> constructor;
+  private:
+    char m_buf[256];
+    std::vector<char> m_heap;
+    char *m_str;
 
-    static NAN_METHOD(defvar);
-    static NAN_METHOD(defnode);
-    static NAN_METHOD(get);
-    static NAN_METHOD(set);
-    static NAN_METHOD(setm);
-    static NAN_METHOD(rm);
-    static NAN_METHOD(mv);
-    static NAN_METHOD(save);
-    static NAN_METHOD(nmatch);
-    static NAN_METHOD(match);
-    static NAN_METHOD(load);
-    static NAN_METHOD(srun);
-    static NAN_METHOD(insertAfter);
-    static NAN_METHOD(insertBefore);
-    static NAN_METHOD(error);
-    static NAN_METHOD(errorMsg);
-    static NAN_METHOD(errorLens);
-    static NAN_METHOD(errorIncl);
-    static NAN_METHOD(print);
+    Utf8Arg(const Utf8Arg &);
+    Utf8Arg &operator=(const Utf8Arg &);
 };
 
-Nan::Persistent<FunctionTemplate> LibAugeas::augeasTemplate;
-Nan::Persistent<Function> LibAugeas::constructor;
-
-void LibAugeas::Init(Handle<Object> target) {
-    Nan::HandleScope scope;
-    // flags for aug_init():
-    NODE_DEFINE_CONSTANT(target, AUG_NONE);
-    NODE_DEFINE_CONSTANT(target, AUG_SAVE_BACKUP);
-    NODE_DEFINE_CONSTANT(target, AUG_SAVE_NEWFILE);
-    NODE_DEFINE_CONSTANT(target, AUG_TYPE_CHECK);
-    NODE_DEFINE_CONSTANT(target, AUG_NO_STDINC);
-    NODE_DEFINE_CONSTANT(target, AUG_SAVE_NOOP);
-    NODE_DEFINE_CONSTANT(target, AUG_NO_LOAD);
-    NODE_DEFINE_CONSTANT(target, AUG_NO_MODL_AUTOLOAD);
-    NODE_DEFINE_CONSTANT(target, AUG_ENABLE_SPAN);
-    NODE_DEFINE_CONSTANT(target, AUG_NO_ERR_CLOSE);
-
-    // error codes:
-    NODE_DEFINE_CONSTANT(target, AUG_NOERROR);
-    NODE_DEFINE_CONSTANT(target, AUG_ENOMEM);
-    NODE_DEFINE_CONSTANT(target, AUG_EINTERNAL);
-    NODE_DEFINE_CONSTANT(target, AUG_EPATHX);
-    NODE_DEFINE_CONSTANT(target, AUG_ENOMATCH);
-    NODE_DEFINE_CONSTANT(target, AUG_EMMATCH);
-    NODE_DEFINE_CONSTANT(target, AUG_ESYNTAX);
-    NODE_DEFINE_CONSTANT(target, AUG_ENOLENS);
-    NODE_DEFINE_CONSTANT(target, AUG_EMXFM);
-    NODE_DEFINE_CONSTANT(target, AUG_ENOSPAN);
-    NODE_DEFINE_CONSTANT(target, AUG_EMVDESC);
-    NODE_DEFINE_CONSTANT(target, AUG_ECMDRUN);
-    NODE_DEFINE_CONSTANT(target, AUG_EBADARG);
-
-    Local<FunctionTemplate> localTemplate = Nan::New<v8::FunctionTemplate>();
-    augeasTemplate.Reset(localTemplate);
-    localTemplate->SetClassName(Nan::New<String>("Augeas").ToLocalChecked());
-    localTemplate->InstanceTemplate()->SetInternalFieldCount(1);
-
-// I do not want copy-n-paste errors here:
-#define _NEW_METHOD(m) Nan::SetPrototypeMethod(localTemplate, #m, m)
-    _NEW_METHOD(defvar);
-    _NEW_METHOD(defnode);
-    _NEW_METHOD(get);
-    _NEW_METHOD(set);
-    _NEW_METHOD(setm);
-    _NEW_METHOD(rm);
-    _NEW_METHOD(mv);
-    _NEW_METHOD(save);
-    _NEW_METHOD(nmatch);
-    _NEW_METHOD(match);
-    _NEW_METHOD(load);
-    _NEW_METHOD(srun);
-    _NEW_METHOD(insertAfter);
-    _NEW_METHOD(insertBefore);
-    _NEW_METHOD(error);
-    _NEW_METHOD(errorMsg);
-    _NEW_METHOD(errorLens);
-    _NEW_METHOD(errorIncl);
-    _NEW_METHOD(print);
+/*
+ * A mutating call on an augeas handle.
+ * Recorded by LibAugeas to be replayed on its replicas.
+ *
+ * Arguments by kind:
+ * SET     - a: path, b: value
+ * SETM    - a: base, b: sub, c: value
+ * RM      - a: path
+ * MV      - a: source, b: destination
+ * INSERT  - a: path, b: label, BEFORE flag
+ * DEFVAR  - a: name, b: expression
+ * DEFNODE - a: name, b: expression, c: value
+ * SRUN    - a: commands
+ * LOAD    - no arguments
+ * LOAD_FILE - a: file
+ * TEXT_STORE - a: lens, b: text, c: path
+ *
+ * The NULL_VALUE flag means that the last argument is NULL
+ * (e. g. aug_set() with NULL value, or aug_defvar() removing a variable).
+ * The FAILED flag means that SRUN failed (or quit) when it was recorded,
+ * so replaying it is expected to fail too.
+ */
+struct AugOp {
+    enum Kind {
+        SET, SETM, RM, MV, INSERT, DEFVAR, DEFNODE, SRUN, LOAD, LOAD_FILE,
+        TEXT_STORE
+    };
+    enum Flags { NULL_VALUE = 1, BEFORE = 2, FAILED = 4 };
+
+    Kind kind;
+    unsigned int flags;
+    std::string a;
+    std::string b;
+    std::string c;
+
+    AugOp(Kind k, const std::string &a_ = std::string(),
+          const std::string &b_ = std::string(),
+          const std::string &c_ = std::string(), unsigned int f = 0)
+        : kind(k), flags(f), a(a_), b(b_), c(c_) {}
+};
 
-    constructor.Reset(localTemplate->GetFunction(ctx()).ToLocalChecked());
+/*
+ * Helper function.
+ * Returns the command words of srun text: aug_srun() runs a command
+ * per line and skips empty lines and comments.
+ */
+std::vector<std::string> srun_commands(const std::string &text) {
+    static const char space[] = " \t\r\f\v";
+    std::vector<std::string> cmds;
+    size_t pos = 0;
+    while (pos < text.length()) {
+        size_t eol = text.find('\n', pos);
+        if (std::string::npos == eol) {
+            eol = text.length();
+        }
+        size_t start = text.find_first_not_of(space, pos);
+        if (start < eol && '#' != text[start]) {
+            size_t end = std::min(text.find_first_of(space, start), eol);
+            cmds.push_back(text.substr(start, end - start));
+        }
+        pos = eol + 1;
+    }
+    return cmds;
 }
 
 /*
- * Creates an JS object to pass it in callback function.
- * This JS objects wraps an LibAugeas object.
- * Only for using within this C++ code.
+ * Helper function.
+ * Whether srun commands read or write files, so that replaying them
+ * later on another handle may give another tree, see record().
  */
-Local<Object> LibAugeas::New(augeas *aug) {
-    LibAugeas *obj = new LibAugeas();
-    obj->m_aug = aug;
-    Local<FunctionTemplate> localTemplate = Nan::New(augeasTemplate);
-    Local<Object> O = localTemplate->InstanceTemplate()->NewInstance(ctx()).ToLocalChecked();
-    obj->Wrap(O);
-    return O;
+bool srun_touches_files(const std::string &text) {
+    std::vector<std::string> cmds = srun_commands(text);
+    for (size_t i = 0; i < cmds.size(); ++i) {
+        if ("load" == cmds[i] || "load-file" == cmds[i] || "save" == cmds[i]) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /*
- * Wrapper of aug_defvar() - define a variable
- * The second argument is optional and if ommited,
- * variable will be removed if exists.
- *
- * On error, throws an exception and returns undefined;
- * on success, returns 0 if expr evaluates to anything
- * other than a nodeset, and the number of nodes if expr
- * evaluates to a nodeset
+ * Operations on more bytes (text, commands) or more operations
+ * at once may add many nodes, see grows_tree().
  */
-NAN_METHOD(LibAugeas::defvar) {
-    Nan::HandleScope scope;
+static const size_t LARGE_TEXT = 64 * 1024;
+static const size_t MANY_OPS = 1000;
 
-    if (info.Length() < 1 || info.Length() > 2) {
-        Nan::ThrowError("Wrong number of arguments");
-        Nan::Undefined();
+/*
+ * Helper function.
+ * Whether srun commands may add many nodes: loading files, storing
+ * text, copying subtrees or setting many nodes, or many commands adding
+ * nodes at all.
+ */
+bool srun_grows_tree(const std::string &text) {
+    std::vector<std::string> cmds = srun_commands(text);
+    size_t adding = 0;
+    for (size_t i = 0; i < cmds.size(); ++i) {
+        const std::string &cmd = cmds[i];
+        if ("load" == cmd || "load-file" == cmd || "store" == cmd ||
+            "cp" == cmd || "copy" == cmd || "setm" == cmd) {
+            return true;
+        }
+        if ("set" == cmd || "ins" == cmd || "insert" == cmd ||
+            "touch" == cmd || "defnode" == cmd) {
+            ++adding;
+        }
     }
+    return adding >= MANY_OPS;
+}
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value n_str(isol(), info[0]);
-    String::Utf8Value e_str(isol(), info[1]);
-
-    const char *name = *n_str;
-    const char *expr = *e_str;
+/*
+ * Helper function.
+ * Whether operation may add many nodes to the tree, so that counting
+ * them (see updateMemory()) is worth it: loading files, srun adding
+ * many nodes (see srun_grows_tree()), large srun or text.
+ */
+bool grows_tree(const AugOp &op) {
+    switch (op.kind) {
+    case AugOp::LOAD:
+    case AugOp::LOAD_FILE:
+        return true;
+    case AugOp::SRUN:
+        return op.a.length() >= LARGE_TEXT || srun_grows_tree(op.a);
+    case AugOp::TEXT_STORE:
+        return op.b.length() >= LARGE_TEXT;
+    default:
+        return false;
+    }
+}
 
-    /* Returns -1 on error; on success, returns 0 if EXPR evaluates to anything
-     * other than a nodeset, and the number of nodes if EXPR evaluates to a
-     * nodeset
-     */
-    int rc = aug_defvar(obj->m_aug, name, info[1]->IsUndefined() ? NULL : expr);
-    if (-1 == rc) {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
-    } else {
-        info.GetReturnValue().Set(Nan::New<Number>(rc));
+bool grows_tree(const std::vector<AugOp> &ops) {
+    if (ops.size() >= MANY_OPS) {
+        return true;
+    }
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (grows_tree(ops[i])) {
+            return true;
+        }
     }
+    return false;
 }
 
+// Scratch subtree for temporary nodes, see ScratchNode:
+static const char SCRATCH_NODE[] = "/augeas/binding";
+// text passed to aug_text_store() and returned by aug_text_retrieve():
+static const char TEXT_NODE[] = "/augeas/binding/text";
+static const char TEXT_OUT_NODE[] = "/augeas/binding/text-out";
+
 /*
- * Wrapper of aug_defnode() - define a node.
- * The defnode command is very useful when you add a node
- * that you need to modify further, e. g. by adding children to it.
- *
- * On error, throws an exception and returns undefined;
- * on success, returns the number of nodes in the nodeset (>= 0)
- *
- * Arguments:
- * name - required
- * expr - required
- * value - optional
- * callback - optional
- *
- * The last argument could be a function. It will be called (synchronously)
- * with one argument set to True if a node was created, and False if it already
- *existed.
+ * Removes the scratch subtree when going out of scope, so temporary
+ * nodes are not left in the tree on any path. Note: aug_rm() resets
+ * the error, so error details must be read before.
  */
-NAN_METHOD(LibAugeas::defnode) {
-    Nan::HandleScope scope;
+class ScratchNode {
+  public:
+    explicit ScratchNode(augeas *aug) : m_aug(aug) {}
+    ~ScratchNode() { aug_rm(m_aug, SCRATCH_NODE); }
 
-    if (info.Length() < 2 || info.Length() > 4) {
-        Nan::ThrowError("Wrong number of arguments");
-        Nan::Undefined();
-    }
+  private:
+    augeas *m_aug;
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value n_str(isol(), info[0]);
-    String::Utf8Value e_str(isol(), info[1]);
-    String::Utf8Value v_str(isol(), info[2]);
+    ScratchNode(const ScratchNode &);
+    ScratchNode &operator=(const ScratchNode &);
+};
 
-    const char *name = *n_str;
-    const char *expr = *e_str;
-    const char *value = NULL;
-    if (!info[2]->IsUndefined() && !info[2]->IsFunction()) {
-        value = *v_str;
+/*
+ * Helper function.
+ * Converts lens name as accepted by createAugeas() ("hosts", "Hosts.lns"
+ * or "@Hosts") into a lens name for aug_text_store() ("Hosts.lns").
+ */
+inline std::string text_lens(const std::string &lens) {
+    std::string name = (lens[0] == '@') ? lens.substr(1) : lens;
+    if (name.rfind(".lns") == std::string::npos) {
+        name += ".lns";
     }
-    int created;
-
-    /* Returns -1 on error; on success, returns
-     * the number of nodes in the nodeset, set created=1 if node created,
-     * set created=0 if node already existed.
-     */
-    int rc = aug_defnode(obj->m_aug, name, expr, value, &created);
-    if (-1 == rc) {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
-    } else {
-        int last = info.Length() - 1;
-        if (info[last]->IsFunction()) {
-            Nan::Callback cb(Local<Function>::Cast(info[last]));
+    return name;
+}
 
-            Local<Value> argv[] = { Nan::New<Boolean>(created == 1) };
+/*
+ * Helper function.
+ * Returns the message of aug_text_store() or aug_text_retrieve() failure
+ * for the tree at path.
+ */
+std::string text_error(augeas *aug, const std::string &path) {
+    // aug_get() resets the error:
+    std::string msg = (AUG_NOERROR != aug_error(aug)) ? aug_error_msg(aug)
+                                                      : std::string();
+    const char *val;
+    std::string errPath = "/augeas/text" + path + "/error/message";
+    if (1 == aug_get(aug, errPath.c_str(), &val) && NULL != val) {
+        msg = std::string("Failed to parse text: ") + val;
+    }
+    if (msg.empty()) {
+        msg = "Failed to parse text";
+    }
+    return msg;
+}
 
-            Nan::TryCatch try_catch;
-            cb.Call(1, argv);
-            if (try_catch.HasCaught()) {
-                Nan::FatalException(try_catch);
-            }
+/*
+ * Parses text with the lens and stores the tree at path.
+ * Returns -1 on error, and the message in *error unless it is NULL.
+ * The text is removed from TEXT_NODE in any case, error details
+ * stay under /augeas/text.
+ */
+int text_store(augeas *aug, const std::string &lens, const std::string &text,
+               const std::string &path, std::string *error) {
+    ScratchNode scratch(aug);
+    int rc = aug_set(aug, TEXT_NODE, text.c_str());
+    if (AUG_NOERROR == rc) {
+        rc = aug_text_store(aug, text_lens(lens).c_str(), TEXT_NODE,
+                            path.c_str());
+    }
+    if (AUG_NOERROR != rc) {
+        if (NULL != error) {
+            *error = text_error(aug, path);
         }
-        info.GetReturnValue().Set(Nan::New<Number>(rc));
+        return -1;
     }
+    return rc;
 }
 
 /*
- * Wrapper of aug_get() - get exactly one value
+ * Serializes the tree at path with the lens (or, if lens is empty,
+ * the file containing path with its own lens, using aug_preview()).
+ * On success *out is allocated with malloc() and may be NULL
+ * if there is no file for path (preview only).
+ * Returns -1 on error, and the message in *error unless it is NULL.
+ * The tree is not changed, but for error details under /augeas/text
+ * (removed on replicas by the caller, see clean_text_error()).
  */
-NAN_METHOD(LibAugeas::get) {
-    Nan::HandleScope scope;
-
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function accepts exactly one argument");
-        Nan::Undefined();
+int render(augeas *aug, const std::string &lens, const std::string &path,
+           char **out, std::string *error) {
+    *out = NULL;
+    if (lens.empty()) {
+        if (aug_preview(aug, path.c_str(), out) < 0) {
+            if (NULL != error) {
+                *error = aug_error_msg(aug);
+            }
+            return -1;
+        }
+        return 0;
     }
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-
-    const char *path = *p_str; // operator*() returns C-string
+    ScratchNode scratch(aug);
+    // no original text, so the tree is rendered with default formatting:
+    int rc = aug_set(aug, TEXT_NODE, "");
+    if (AUG_NOERROR == rc) {
+        rc = aug_text_retrieve(aug, text_lens(lens).c_str(), TEXT_NODE,
+                               path.c_str(), TEXT_OUT_NODE);
+    }
+    if (AUG_NOERROR != rc) {
+        if (NULL != error) {
+            *error = text_error(aug, path);
+        }
+        return -1;
+    }
+    const char *val;
+    if (1 == aug_get(aug, TEXT_OUT_NODE, &val) && NULL != val) {
+        *out = strdup(val);
+    }
+    return 0;
+}
+
+/*
+ * Helper function.
+ * Removes error details of failed render() of path, so that it does not
+ * change the tree of a replica.
+ */
+inline void clean_text_error(augeas *aug, const std::string &path) {
+    aug_rm(aug, ("/augeas/text" + path).c_str());
+}
+
+/*
+ * Applies recorded operation to the augeas handle.
+ * Returns a negative value on error.
+ */
+int apply_op(augeas *aug, const AugOp &op) {
+    const bool null_value = (op.flags & AugOp::NULL_VALUE) != 0;
+    int created;
+
+    switch (op.kind) {
+    case AugOp::SET:
+        return aug_set(aug, op.a.c_str(), null_value ? NULL : op.b.c_str());
+    case AugOp::SETM:
+        return aug_setm(aug, op.a.c_str(), op.b.c_str(),
+                        null_value ? NULL : op.c.c_str());
+    case AugOp::RM:
+        return aug_rm(aug, op.a.c_str());
+    case AugOp::MV:
+        return aug_mv(aug, op.a.c_str(), op.b.c_str());
+    case AugOp::INSERT:
+        return aug_insert(aug, op.a.c_str(), op.b.c_str(),
+                          (op.flags & AugOp::BEFORE) ? 1 : 0);
+    case AugOp::DEFVAR:
+        return aug_defvar(aug, op.a.c_str(), null_value ? NULL : op.b.c_str());
+    case AugOp::DEFNODE:
+        return aug_defnode(aug, op.a.c_str(), op.b.c_str(),
+                           null_value ? NULL : op.c.c_str(), &created);
+    case AugOp::SRUN:
+        return aug_srun(aug, NULL, op.a.c_str());
+    case AugOp::LOAD:
+        return aug_load(aug);
+    case AugOp::LOAD_FILE:
+        return aug_load_file(aug, op.a.c_str());
+    case AugOp::TEXT_STORE:
+        return text_store(aug, op.a, op.b, op.c, NULL);
+    }
+    return -1;
+}
+
+/*
+ * Journal serialization format:
+ *
+ * "AUGJ" version(1 byte) then for every operation:
+ * kind(1 byte) flags(1 byte) and arguments used by this kind,
+ * each argument is length(4 bytes, little-endian) and bytes.
+ */
+static const char JOURNAL_MAGIC[] = "AUGJ";
+static const unsigned char JOURNAL_VERSION = 1;
+
+// number of arguments used by each kind of AugOp:
+static const int OP_NARGS[] = { 2, 3, 1, 2, 2, 2, 3, 1, 0, 1, 3 };
+
+inline void put_arg(std::string &out, const std::string &arg) {
+    uint32_t len = arg.length();
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((len >> (8 * i)) & 0xff));
+    }
+    out.append(arg);
+}
+
+std::string serialize_ops(const std::vector<AugOp> &ops) {
+    std::string out(JOURNAL_MAGIC, 4);
+    out.push_back(static_cast<char>(JOURNAL_VERSION));
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const AugOp &op = ops[i];
+        out.push_back(static_cast<char>(op.kind));
+        out.push_back(static_cast<char>(op.flags));
+        const std::string *args[] = { &op.a, &op.b, &op.c };
+        for (int j = 0; j < OP_NARGS[op.kind]; ++j) {
+            put_arg(out, *args[j]);
+        }
+    }
+    return out;
+}
+
+/*
+ * Parses journal created by serialize_ops().
+ * Returns false if data is not a valid journal.
+ */
+bool parse_ops(const char *data, size_t len, std::vector<AugOp> &ops) {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = p + len;
+
+    if (len < 5 || memcmp(p, JOURNAL_MAGIC, 4) != 0 ||
+        p[4] != JOURNAL_VERSION) {
+        return false;
+    }
+    p += 5;
+
+    while (p < end) {
+        if (end - p < 2 || p[0] > AugOp::TEXT_STORE) {
+            return false;
+        }
+        AugOp op(static_cast<AugOp::Kind>(p[0]), "", "", "", p[1]);
+        p += 2;
+        std::string *args[] = { &op.a, &op.b, &op.c };
+        for (int j = 0; j < OP_NARGS[op.kind]; ++j) {
+            if (end - p < 4) {
+                return false;
+            }
+            uint32_t alen = p[0] | (p[1] << 8) | (p[2] << 16) |
+                            (static_cast<uint32_t>(p[3]) << 24);
+            p += 4;
+            if (static_cast<size_t>(end - p) < alen) {
+                return false;
+            }
+            args[j]->assign(reinterpret_cast<const char *>(p), alen);
+            p += alen;
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+/*
+ * Files enumerated, but not loaded yet in lazy mode.
+ *
+ * In lazy mode incl globs are removed from transforms, so aug_load()
+ * does not parse any file. A file is loaded when a path under
+ * /files/<that file> is used for the first time: its name is added
+ * to the incl of its transform and aug_load_file() is called.
+ */
+struct LazyFiles {
+    // transform (e. g. /augeas/load/Hosts) => its original incl globs:
+    std::map<std::string, std::vector<std::string> > incl;
+    // file => transform:
+    std::map<std::string, std::string> pending;
+};
+
+/*
+ * Helper function.
+ * Returns values of all nodes matching path.
+ */
+std::vector<std::string> get_values(augeas *aug, const std::string &path) {
+    std::vector<std::string> values;
+    char **matches = NULL;
+    const char *val;
+    int n = aug_match(aug, path.c_str(), &matches);
+    for (int i = 0; i < n; ++i) {
+        if (1 == aug_get(aug, matches[i], &val) && NULL != val) {
+            values.push_back(val);
+        }
+    }
+    free_matches(matches, n);
+    return values;
+}
+
+/*
+ * Helper function.
+ * fnmatch() flags for incl/excl globs, as in augeas: '*' does not
+ * match '/', unless the glob has '**', which matches any directories.
+ */
+inline int glob_flags(const std::string &glob) {
+    return std::string::npos == glob.find("**") ? FNM_PATHNAME : 0;
+}
+
+/*
+ * Helper function.
+ * Matches file name against incl glob the way augeas does.
+ */
+inline bool incl_matches(const std::string &glob, const std::string &file) {
+    return 0 == fnmatch(glob.c_str(), file.c_str(), glob_flags(glob));
+}
+
+/*
+ * Helper function.
+ * Matches file name against excl glob the way augeas does:
+ * globs without '/' match the base name.
+ */
+inline bool excl_matches(const std::string &glob, const std::string &file) {
+    const char *name = file.c_str();
+    if (std::string::npos == glob.find('/')) {
+        name += file.rfind('/') + 1; // npos + 1 == 0
+    }
+    return 0 == fnmatch(glob.c_str(), name, glob_flags(glob));
+}
+
+/*
+ * Helper function.
+ * Appends regular files under dir (under root) matching incl glob
+ * to files, walking all subdirectories. Symbolic links to directories
+ * are not followed.
+ */
+void walk_files(const std::string &root, const std::string &dir,
+                const std::string &glob, std::vector<std::string> &files) {
+    DIR *d = opendir((root + dir).c_str());
+    if (NULL == d) {
+        return;
+    }
+    while (struct dirent *ent = readdir(d)) {
+        if (0 == strcmp(ent->d_name, ".") || 0 == strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        std::string file = (dir == "/" ? dir : dir + "/") + ent->d_name;
+        struct stat st;
+        if (0 != lstat((root + file).c_str(), &st)) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            walk_files(root, file, glob, files);
+        } else if (0 == stat((root + file).c_str(), &st) &&
+                   S_ISREG(st.st_mode) && incl_matches(glob, file)) {
+            files.push_back(file);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Helper function.
+ * Returns regular files (without root) matching incl glob.
+ * glob(3) does not recurse on '**', so then the directories
+ * under its literal prefix are walked instead.
+ */
+std::vector<std::string> incl_files(const std::string &root,
+                                    const std::string &incl) {
+    std::vector<std::string> files;
+    if (std::string::npos != incl.find("**")) {
+        size_t wild = incl.find_first_of("*?[");
+        size_t slash = incl.rfind('/', wild);
+        if (std::string::npos != slash) {
+            walk_files(root, slash > 0 ? incl.substr(0, slash) : "/", incl,
+                       files);
+        }
+        return files;
+    }
+
+    glob_t gl;
+    if (0 != glob((root + incl).c_str(), GLOB_NOSORT, NULL, &gl)) {
+        return files;
+    }
+    for (size_t i = 0; i < gl.gl_pathc; ++i) {
+        struct stat st;
+        if (0 == stat(gl.gl_pathv[i], &st) && S_ISREG(st.st_mode)) {
+            files.push_back(gl.gl_pathv[i] + root.length());
+        }
+    }
+    globfree(&gl);
+    return files;
+}
+
+/*
+ * Replaces aug_load() in lazy mode: enumerates files matching
+ * incl globs of all transforms, removes the globs and loads
+ * nothing but files already included by name.
+ * Returns the value of aug_load().
+ */
+int lazy_load(augeas *aug, LazyFiles &lazy) {
+    // restore globs removed by the previous call:
+    for (std::map<std::string, std::vector<std::string> >::iterator it =
+             lazy.incl.begin();
+         it != lazy.incl.end(); ++it) {
+        aug_rm(aug, (it->first + "/incl").c_str());
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            aug_set(aug, (it->first + "/incl[last()+1]").c_str(),
+                    it->second[i].c_str());
+        }
+    }
+    lazy.incl.clear();
+    lazy.pending.clear();
+
+    // e. g. "/" or "/srv/chroot/":
+    const char *val = NULL;
+    std::string root;
+    if (1 == aug_get(aug, "/augeas/root", &val) && NULL != val) {
+        root = val;
+    }
+    if (!root.empty() && root[root.length() - 1] == '/') {
+        root.erase(root.length() - 1);
+    }
+
+    char **xfms = NULL;
+    int nxfms = aug_match(aug, "/augeas/load/*", &xfms);
+    for (int i = 0; i < nxfms; ++i) {
+        std::string xfm = xfms[i];
+        std::vector<std::string> incl = get_values(aug, xfm + "/incl");
+        std::vector<std::string> excl = get_values(aug, xfm + "/excl");
+
+        for (size_t j = 0; j < incl.size(); ++j) {
+            std::vector<std::string> files = incl_files(root, incl[j]);
+            for (size_t k = 0; k < files.size(); ++k) {
+                const std::string &file = files[k];
+                bool excluded = false;
+                for (size_t e = 0; e < excl.size() && !excluded; ++e) {
+                    excluded = excl_matches(excl[e], file);
+                }
+                // the first transform wins:
+                if (!excluded && lazy.pending.find(file) == lazy.pending.end()) {
+                    lazy.pending[file] = xfm;
+                }
+            }
+        }
+
+        lazy.incl[xfm] = incl;
+        aug_rm(aug, (xfm + "/incl").c_str());
+    }
+    free_matches(xfms, nxfms);
+
+    return aug_load(aug);
+}
+
+/*
+ * Returns the literal part of a path expression under /files,
+ * i. e. steps before the first step with wildcards, predicates,
+ * variables, functions or '//'. Examples:
+ *
+ * /files/etc/hosts/1/ipaddr   => /etc/hosts/1/ipaddr
+ * /files/etc/hosts[1]/ipaddr  => /etc/hosts
+ * /files//error               => (empty)
+ *
+ * Returns false if the path does not point to /files.
+ */
+bool files_prefix(const std::string &path, std::string &prefix) {
+    std::string p;
+    if (path.compare(0, 7, "/files/") == 0 || path == "/files") {
+        p = path.substr(6);
+    } else if (!path.empty() && path[0] != '/' && path[0] != '$') {
+        p = "/" + path; // relative to /augeas/context, /files by default
+    } else {
+        return false;
+    }
+
+    prefix.clear();
+    size_t pos = 0;
+    while (pos < p.length()) {
+        size_t next = p.find('/', pos + 1);
+        std::string step =
+            p.substr(pos + 1, (next == std::string::npos ? p.length() : next) -
+                                  pos - 1);
+        size_t special = step.find_first_of("*[]()$|:\\ ");
+        if (step.empty() || step == "." || step == "..") {
+            break;
+        }
+        if (special != std::string::npos) {
+            // /files/etc/hosts[1] => /etc/hosts:
+            if (step[special] == '[' && special > 0) {
+                prefix += "/" + step.substr(0, special);
+            }
+            break;
+        }
+        prefix += "/" + step;
+        if (next == std::string::npos) {
+            break;
+        }
+        pos = next;
+    }
+    return true;
+}
+
+/*
+ * Returns files which must be loaded before evaluating path expression
+ * and forgets them. Paths outside of /files (including variables)
+ * do not require any files.
+ */
+std::vector<std::string> lazy_files(LazyFiles &lazy, const std::string &path) {
+    std::vector<std::string> files;
+    std::string prefix;
+
+    if (lazy.pending.empty() || !files_prefix(path, prefix)) {
+        return files;
+    }
+
+    // files under prefix:
+    std::map<std::string, std::string>::iterator it =
+        lazy.pending.lower_bound(prefix);
+    while (it != lazy.pending.end() &&
+           it->first.compare(0, prefix.length(), prefix) == 0) {
+        if (it->first.length() == prefix.length() ||
+            it->first[prefix.length()] == '/' || prefix.empty()) {
+            files.push_back(it->first);
+        }
+        ++it;
+    }
+
+    // file containing prefix:
+    for (size_t pos = prefix.rfind('/'); pos != std::string::npos && pos > 0;
+         pos = prefix.rfind('/', pos - 1)) {
+        if (lazy.pending.count(prefix.substr(0, pos))) {
+            files.push_back(prefix.substr(0, pos));
+        }
+    }
+
+    return files;
+}
+
+/*
+ * Helper function.
+ * Returns the subtree containing all nodes path expression can refer to,
+ * i. e. its literal part (see files_prefix()), e. g. "/files/etc/hosts"
+ * for "/files/etc/hosts//ipaddr[. = '::1']". Returns empty string
+ * (the whole tree) if the expression is relative, uses variables,
+ * axes, unions or absolute paths in predicates.
+ */
+std::string path_scope(const std::string &expr) {
+    if (expr.empty() || '/' != expr[0]) {
+        return std::string();
+    }
+
+    int depth = 0;
+    char quote = 0;
+    char prev = 0;
+    for (size_t i = 0; i < expr.length(); ++i) {
+        char c = expr[i];
+        if (0 != quote) {
+            quote = (c == quote) ? 0 : quote;
+            continue;
+        }
+        char next = (i + 1 < expr.length()) ? expr[i + 1] : 0;
+        if ('$' == c || '|' == c || ('.' == c && '.' == next) ||
+            (':' == c && ':' == next)) {
+            return std::string();
+        }
+        if ('\'' == c || '"' == c) {
+            quote = c;
+        } else if ('[' == c || '(' == c) {
+            ++depth;
+        } else if (']' == c || ')' == c) {
+            --depth;
+        } else if ('/' == c && depth > 0 &&
+                   (isspace(prev) || strchr("[(=<>!,+-", prev))) {
+            // absolute path in predicate, e. g. [. = /files/etc/hostname]
+            return std::string();
+        }
+        prev = c;
+    }
+
+    std::string scope;
+    size_t pos = 0;
+    while (pos < expr.length()) {
+        size_t next = expr.find('/', pos + 1);
+        std::string step = expr.substr(pos + 1, (next == std::string::npos
+                                                      ? expr.length()
+                                                      : next) - pos - 1);
+        size_t special = step.find_first_of("*[]()\\ ");
+        if (step.empty() || step == ".") {
+            break;
+        }
+        if (special != std::string::npos) {
+            if (step[special] == '[' && special > 0) {
+                scope += "/" + step.substr(0, special);
+            }
+            break;
+        }
+        scope += "/" + step;
+        if (next == std::string::npos) {
+            break;
+        }
+        pos = next;
+    }
+    return scope;
+}
+
+/*
+ * Whether one subtree contains the other (empty scope is the whole tree).
+ */
+inline bool scopes_overlap(const std::string &a, const std::string &b) {
+    return a.compare(0, b.length(), b) == 0 || b.compare(0, a.length(), a) == 0;
+}
+
+/*
+ * Cached result of get(), match() or nmatch(), see LibAugeas::cache().
+ */
+struct CacheEntry {
+    std::string scope; // see path_scope()
+    int rc;
+    bool null;         // get(): the value is NULL
+    std::string value; // get()
+    std::vector<std::string> paths; // match()
+    std::list<std::string>::iterator lru; // the key in LibAugeas::m_lru
+    size_t bytes; // reported to V8, see LibAugeas::cacheStore()
+
+    CacheEntry() : rc(0), null(true), bytes(0) {}
+};
+
+/*
+ * Tracing of augeas operations, see setTracer().
+ */
+struct Span {
+    const char *name;
+    unsigned int handle;
+    std::string path;
+    int files;      // the number of loaded or saved files, -1 if unknown
+    uint64_t start; // uv_hrtime() when called or queued
+    uint64_t run;   // when started on the threadpool, 0 if sync
+    uint64_t end;
+};
+
+static Nan::Callback *tracer = NULL;
+static std::vector<Span> spans; // not passed to the tracer yet
+static uv_async_t traceAsync;
+// setTracer() called by the tracer, applied when it returns:
+static bool traceFlushing = false;
+static bool traceReplace = false;
+static Nan::Callback *nextTracer = NULL;
+
+inline bool tracing() {
+    return NULL != tracer;
+}
+
+/*
+ * Buffers a span. Spans are passed to the tracer
+ * once per event loop iteration by traceFlush().
+ */
+void trace(const char *name, unsigned int handle, const std::string &path,
+           int files, uint64_t start, uint64_t run, uint64_t end) {
+    if (!tracing()) {
+        return;
+    }
+    Span span = { name, handle, path, files, start, run, end };
+    spans.push_back(span);
+    uv_async_send(&traceAsync);
+}
+
+inline double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void traceFlush(uv_async_t *) {
+    Nan::HandleScope scope;
+
+    std::vector<Span> batch;
+    batch.swap(spans);
+    if (!tracing() || batch.empty()) {
+        return;
+    }
+
+    Local<Array> arr = Nan::New<Array>(static_cast<int>(batch.size()));
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const Span &sp = batch[i];
+        Local<Object> o = Nan::New<Object>();
+        o->Set(ctx(), Nan::New<String>("name").ToLocalChecked(),
+               Nan::New<String>(sp.name).ToLocalChecked());
+        o->Set(ctx(), Nan::New<String>("handle").ToLocalChecked(),
+               Nan::New<Number>(sp.handle));
+        if (!sp.path.empty()) {
+            o->Set(ctx(), Nan::New<String>("path").ToLocalChecked(),
+                   Nan::New<String>(sp.path).ToLocalChecked());
+        }
+        if (sp.files >= 0) {
+            o->Set(ctx(), Nan::New<String>("files").ToLocalChecked(),
+                   Nan::New<Number>(sp.files));
+        }
+        o->Set(ctx(), Nan::New<String>("start").ToLocalChecked(),
+               Nan::New<Number>(ms(sp.start)));
+        o->Set(ctx(), Nan::New<String>("duration").ToLocalChecked(),
+               Nan::New<Number>(ms(sp.end - sp.start)));
+        if (0 != sp.run) {
+            o->Set(ctx(), Nan::New<String>("queue").ToLocalChecked(),
+                   Nan::New<Number>(ms(sp.run - sp.start)));
+            o->Set(ctx(), Nan::New<String>("run").ToLocalChecked(),
+                   Nan::New<Number>(ms(sp.end - sp.run)));
+        }
+        arr->Set(ctx(), i, o);
+    }
+
+    Local<Value> argv[] = { arr };
+
+    Nan::TryCatch try_catch;
+    traceFlushing = true;
+    tracer->Call(1, argv);
+    traceFlushing = false;
+    if (traceReplace) {
+        delete tracer;
+        tracer = nextTracer;
+        nextTracer = NULL;
+        traceReplace = false;
+    }
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Traces sync operation from construction to destruction.
+ * Costs nothing but a check if there is no tracer.
+ * Note: path must outlive the span.
+ */
+class OpSpan {
+  public:
+    OpSpan(const char *name, unsigned int handle, const char *path = NULL)
+        : m_name(name), m_handle(handle), m_path(path), m_files(-1),
+          m_start(tracing() ? uv_hrtime() : 0) {}
+    ~OpSpan() {
+        if (active()) {
+            trace(m_name, m_handle, m_path ? m_path : "", m_files, m_start, 0,
+                  uv_hrtime());
+        }
+    }
+
+    bool active() const { return 0 != m_start; }
+    void files(int n) { m_files = n; }
+
+  private:
+    const char *m_name;
+    unsigned int m_handle;
+    const char *m_path;
+    int m_files;
+    uint64_t m_start;
+};
+
+/*
+ * Timestamps of async operation for tracing.
+ */
+struct AsyncTimes {
+    uint64_t queued;
+    uint64_t started;
+    uint64_t finished;
+
+    AsyncTimes() : queued(uv_hrtime()), started(0), finished(0) {}
+};
+
+/*
+ * Helper function.
+ * Returns the number of loaded files (each has 'mtime').
+ */
+inline int loaded_files(augeas *aug) {
+    return aug_match(aug, "/augeas/files//mtime", NULL);
+}
+
+struct WriteBatchUV;
+struct TreeCopyUV;
+
+class LibAugeas : public node::ObjectWrap {
+  public:
+    static void Init(Handle<Object> target);
+    static Local<Object> New(augeas *aug, const std::string &root,
+                             const std::string &loadpath, unsigned int flags,
+                             bool loaded);
+
+    unsigned int id() const { return m_id; }
+    void record(const AugOp &op, bool journal = true);
+    void saved();
+    void lazy(LazyFiles &files);
+    void updateMemory();
+    // async operations on the threadpool, see close():
+    void inflight(int n);
+    void invalidate(const std::string &scope);
+
+  protected:
+    augeas *m_aug;
+    unsigned int m_id; // for tracing
+    LibAugeas();
+    ~LibAugeas();
+
+    // aug_init() arguments, needed to create replicas:
+    std::string m_root;
+    std::string m_loadpath;
+    unsigned int m_flags;
+    bool m_loaded; // whether files were loaded at least once
+
+    /*
+     * What a new replica needs besides loading files, see snapshot():
+     * whether the tree may differ from files, and variable definitions
+     * by name.
+     */
+    bool m_modified;
+    std::map<std::string, AugOp> m_vars;
+    std::vector<LibAugeas *> m_replicas;
+    // whether record() needs the operation, otherwise changed() is enough:
+    bool recording() const {
+        return m_caching || m_journaling || !m_replicas.empty();
+    }
+    void changed() { m_modified = true; }
+
+    /*
+     * Whether get(), set() and match() can call augeas right away:
+     * no tracing, cache, lazy loading, journal, replicas, async operation
+     * or pending work of closed(). Checked once instead of each of them,
+     * m_plain is updated by features() whenever any of them changes.
+     */
+    bool m_plain;
+    void features();
+    bool plain() const { return m_plain & !tracing(); }
+
+    // Operations recorded between journalStart() and journalStop():
+    bool m_journaling;
+    std::vector<AugOp> m_journal;
+
+    // Lazy mode, see LazyFiles:
+    bool m_lazy;
+    LazyFiles m_lazyFiles;
+    void lazyTouch(const std::string &path);
+    void touchOp(const AugOp &op);
+    inline void touch(const char *path) {
+        if (m_lazy) {
+            lazyTouch(path);
+        }
+    }
+    inline void touch(const std::string &path) {
+        if (m_lazy) {
+            lazyTouch(path);
+        }
+    }
+
+    // Replica state, see replayPending():
+    LibAugeas *m_primary; // NULL if primary is gone or not a replica
+    bool m_readonly;
+    augeas *m_back; // the second handle, replaying operations
+    bool m_busy;    // being created or replaying operations on the threadpool
+    std::deque<AugOp> m_ops; // recorded by primary, not applied to both
+    size_t m_frontAt;        // the number of m_ops applied to m_aug
+    size_t m_backAt;         // and to m_back
+    std::string m_failed; // why the replica is out of sync, empty if it is not
+    uv_mutex_t m_lock; // held while m_aug is used by the threadpool
+
+    friend class AugLock;
+    friend class AugNodeset;
+
+    // Native memory reported to V8, see updateMemory():
+    int64_t m_memory;
+    void adjustMemory(int64_t bytes);
+
+    // Result cache of get(), match() and nmatch(), see cache():
+    bool m_caching;
+    std::map<std::string, CacheEntry> m_cache; // by 'g', 'm' or 'n' + expr
+    std::list<std::string> m_lru; // keys, the most recently used first
+    int64_t m_cacheBytes;
+    double m_hits;
+    double m_misses;
+    CacheEntry *cached(char kind, const char *expr);
+    void cacheStore(char kind, const char *expr, CacheEntry &entry);
+    void cacheErase(std::map<std::string, CacheEntry>::iterator it);
+    void cacheClear();
+    void invalidate(const AugOp &op);
+
+    bool m_closed;  // close() was called
+    int m_inflight; // async operations using m_aug
+    bool closed();
+
+    /*
+     * Variables of nodesets: live ones with expressions (a replica
+     * defines them again on the other handle, see replayPending()),
+     * garbage collected ones to undefine at the next call, see undefine(),
+     * and ones to undefine on the other handle of a replica.
+     */
+    std::map<std::string, std::string> m_nodesets;
+    std::vector<std::string> m_deadVars;
+    std::vector<std::string> m_deadBack;
+    void undefine();
+
+    // Write batches, see writeBatch():
+    WriteBatchUV *m_batch;   // waits for the running one, NULL if none
+    WriteBatchUV *m_running; // on the threadpool, NULL if none
+    void startWrites();
+    void syncWrites();
+    void recordWrites(WriteBatchUV *wuv);
+    void detach();
+
+    // Copies of the tree for replicas after srun, see copyLater():
+    std::deque<TreeCopyUV *> m_copies; // not passed to replicas yet
+    int m_copying;                     // on the threadpool
+    void copyLater();
+    void takeCopies(bool copy);
+    void sendCopies(bool all);
+    void forward(const std::vector<AugOp> &ops);
+    static void copyWork(uv_work_t *req);
+    static void copyAfter(uv_work_t *req);
+
+    std::vector<AugOp> snapshot();
+    bool readonly();
+    static void replayPending(LibAugeas *replica);
+    static void replayWork(uv_work_t *req);
+    static void replayAfter(uv_work_t *req);
+    static void replicaWork(uv_work_t *req);
+    static void replicaAfter(uv_work_t *req);
+
+    static Nan::Persistent<FunctionTemplate> augeasTemplate;
+    static Nan::Persistent<Function> constructor;
+
+    static NAN_METHOD(construct);
+    static NAN_METHOD(close);
+    static NAN_METHOD(defvar);
+    static NAN_METHOD(defnode);
+    static NAN_METHOD(get);
+    static NAN_METHOD(set);
+    static NAN_METHOD(getBuffer);
+    static NAN_METHOD(setBuffer);
+    static NAN_METHOD(getBuffers);
+    static NAN_METHOD(setBuffers);
+    static NAN_METHOD(setm);
+    static NAN_METHOD(rm);
+    static NAN_METHOD(mv);
+    static NAN_METHOD(save);
+    static NAN_METHOD(saveFiles);
+    static void saveFilesWork(uv_work_t *req);
+    static void saveFilesAfter(uv_work_t *req);
+    static NAN_METHOD(nmatch);
+    static NAN_METHOD(match);
+    static NAN_METHOD(explain);
+    static NAN_METHOD(nodeset);
+    static NAN_METHOD(aggregate);
+    static NAN_METHOD(cache);
+    static NAN_METHOD(cacheStats);
+    static void aggregateWork(uv_work_t *req);
+    static void aggregateAfter(uv_work_t *req);
+    static NAN_METHOD(load);
+    static NAN_METHOD(srun);
+    static NAN_METHOD(insertAfter);
+    static NAN_METHOD(insertBefore);
+    static NAN_METHOD(error);
+    static NAN_METHOD(errorMsg);
+    static NAN_METHOD(errorLens);
+    static NAN_METHOD(errorIncl);
+    static NAN_METHOD(loadErrors);
+    static NAN_METHOD(print);
+    static NAN_METHOD(parseText);
+    static NAN_METHOD(renderText);
+    static NAN_METHOD(preview);
+    static void renderPaths(const Nan::FunctionCallbackInfo<Value> &info,
+                            const std::string &lens, int pathArg);
+    static void renderWork(uv_work_t *req);
+    static void renderAfter(uv_work_t *req);
+    static void parseTextWork(uv_work_t *req);
+    static void parseTextAfter(uv_work_t *req);
+    static NAN_METHOD(replica);
+    static NAN_METHOD(journalStart);
+    static NAN_METHOD(journalStop);
+    static NAN_METHOD(journal);
+    static NAN_METHOD(replay);
+    static NAN_METHOD(writeBatch);
+    static void writeBatchWork(uv_work_t *req);
+    static void writeBatchAfter(uv_work_t *req);
+};
+
+/*
+ * Locks m_aug while it is used. Async operations hold the lock
+ * on the threadpool (AugLock(obj, true)), so a sync call made meanwhile
+ * waits until they are done instead of using the handle at the same time.
+ * On the main thread the lock is taken only if an async operation
+ * is in progress, otherwise it costs a check. Replicas replay operations
+ * on another handle (see replayPending()), which is never locked.
+ */
+class AugLock {
+  public:
+    explicit AugLock(LibAugeas *obj, bool always = false)
+        : m_obj(always || obj->m_inflight > 0 ? obj : NULL) {
+        if (NULL != m_obj) {
+            uv_mutex_lock(&m_obj->m_lock);
+        }
+    }
+    ~AugLock() {
+        if (NULL != m_obj) {
+            uv_mutex_unlock(&m_obj->m_lock);
+        }
+    }
+
+  private:
+    LibAugeas *m_obj;
+};
+
+/*
+ * Nodeset kept in augeas variable, see LibAugeas::nodeset().
+ */
+class AugNodeset : public node::ObjectWrap {
+  public:
+    static void Init(Handle<Object> target);
+    static Local<Object> New(Local<Object> handle, const std::string &var);
+
+  protected:
+    AugNodeset() : m_obj(NULL) {}
+    ~AugNodeset();
+
+    Nan::Persistent<Object> m_handle; // keeps m_obj alive
+    LibAugeas *m_obj;
+    std::string m_var; // empty after free()
+
+    static AugNodeset *unwrap(const Nan::FunctionCallbackInfo<Value> &info);
+    static bool index(const Nan::FunctionCallbackInfo<Value> &info,
+                      AugNodeset *ns, int &i);
+    Local<Value> entry(int i);
+
+    static Nan::Persistent<FunctionTemplate> nodesetTemplate;
+
+    static NAN_METHOD(count);
+    static NAN_METHOD(get);
+    static NAN_METHOD(label);
+    static NAN_METHOD(value);
+    static NAN_METHOD(path);
+    static NAN_METHOD(entries);
+    static NAN_METHOD(free);
+};
+
+Nan::Persistent<FunctionTemplate> LibAugeas::augeasTemplate;
+Nan::Persistent<Function> LibAugeas::constructor;
+
+void LibAugeas::Init(Handle<Object> target) {
+    Nan::HandleScope scope;
+    // flags for aug_init():
+    NODE_DEFINE_CONSTANT(target, AUG_NONE);
+    NODE_DEFINE_CONSTANT(target, AUG_SAVE_BACKUP);
+    NODE_DEFINE_CONSTANT(target, AUG_SAVE_NEWFILE);
+    NODE_DEFINE_CONSTANT(target, AUG_TYPE_CHECK);
+    NODE_DEFINE_CONSTANT(target, AUG_NO_STDINC);
+    NODE_DEFINE_CONSTANT(target, AUG_SAVE_NOOP);
+    NODE_DEFINE_CONSTANT(target, AUG_NO_LOAD);
+    NODE_DEFINE_CONSTANT(target, AUG_NO_MODL_AUTOLOAD);
+    NODE_DEFINE_CONSTANT(target, AUG_ENABLE_SPAN);
+    NODE_DEFINE_CONSTANT(target, AUG_NO_ERR_CLOSE);
+
+    // error codes:
+    NODE_DEFINE_CONSTANT(target, AUG_NOERROR);
+    NODE_DEFINE_CONSTANT(target, AUG_ENOMEM);
+    NODE_DEFINE_CONSTANT(target, AUG_EINTERNAL);
+    NODE_DEFINE_CONSTANT(target, AUG_EPATHX);
+    NODE_DEFINE_CONSTANT(target, AUG_ENOMATCH);
+    NODE_DEFINE_CONSTANT(target, AUG_EMMATCH);
+    NODE_DEFINE_CONSTANT(target, AUG_ESYNTAX);
+    NODE_DEFINE_CONSTANT(target, AUG_ENOLENS);
+    NODE_DEFINE_CONSTANT(target, AUG_EMXFM);
+    NODE_DEFINE_CONSTANT(target, AUG_ENOSPAN);
+    NODE_DEFINE_CONSTANT(target, AUG_EMVDESC);
+    NODE_DEFINE_CONSTANT(target, AUG_ECMDRUN);
+    NODE_DEFINE_CONSTANT(target, AUG_EBADARG);
+
+    Local<FunctionTemplate> localTemplate =
+        Nan::New<v8::FunctionTemplate>(construct);
+    augeasTemplate.Reset(localTemplate);
+    localTemplate->SetClassName(Nan::New<String>("Augeas").ToLocalChecked());
+    localTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+// I do not want copy-n-paste errors here:
+#define _NEW_METHOD(m) Nan::SetPrototypeMethod(localTemplate, #m, m)
+    _NEW_METHOD(close);
+    _NEW_METHOD(defvar);
+    _NEW_METHOD(defnode);
+    _NEW_METHOD(get);
+    _NEW_METHOD(set);
+    _NEW_METHOD(getBuffer);
+    _NEW_METHOD(setBuffer);
+    _NEW_METHOD(getBuffers);
+    _NEW_METHOD(setBuffers);
+    _NEW_METHOD(setm);
+    _NEW_METHOD(rm);
+    _NEW_METHOD(mv);
+    _NEW_METHOD(save);
+    _NEW_METHOD(saveFiles);
+    _NEW_METHOD(nmatch);
+    _NEW_METHOD(match);
+    _NEW_METHOD(explain);
+    _NEW_METHOD(nodeset);
+    _NEW_METHOD(aggregate);
+    _NEW_METHOD(cache);
+    _NEW_METHOD(cacheStats);
+    _NEW_METHOD(load);
+    _NEW_METHOD(srun);
+    _NEW_METHOD(insertAfter);
+    _NEW_METHOD(insertBefore);
+    _NEW_METHOD(error);
+    _NEW_METHOD(errorMsg);
+    _NEW_METHOD(errorLens);
+    _NEW_METHOD(errorIncl);
+    _NEW_METHOD(loadErrors);
+    _NEW_METHOD(print);
+    _NEW_METHOD(parseText);
+    _NEW_METHOD(renderText);
+    _NEW_METHOD(preview);
+    _NEW_METHOD(replica);
+    _NEW_METHOD(journalStart);
+    _NEW_METHOD(journalStop);
+    _NEW_METHOD(journal);
+    _NEW_METHOD(replay);
+    _NEW_METHOD(writeBatch);
+
+    constructor.Reset(localTemplate->GetFunction(ctx()).ToLocalChecked());
+
+    // to extend the prototype in JS, e. g. with Symbol.dispose:
+    target->Set(ctx(), Nan::New<String>("Augeas").ToLocalChecked(),
+                Nan::New(constructor));
+}
+
+/*
+ * Creates an JS object to pass it in callback function.
+ * This JS objects wraps an LibAugeas object.
+ * Only for using within this C++ code.
+ */
+Local<Object> LibAugeas::New(augeas *aug, const std::string &root,
+                             const std::string &loadpath, unsigned int flags,
+                             bool loaded) {
+    LibAugeas *obj = new LibAugeas();
+    static unsigned int lastId = 0;
+    obj->m_aug = aug;
+    obj->m_id = ++lastId;
+    obj->m_root = root;
+    obj->m_loadpath = loadpath;
+    obj->m_flags = flags;
+    obj->m_loaded = loaded;
+    Local<FunctionTemplate> localTemplate = Nan::New(augeasTemplate);
+    Local<Object> O = localTemplate->InstanceTemplate()->NewInstance(ctx()).ToLocalChecked();
+    obj->Wrap(O);
+    return O;
+}
+
+/*
+ * Augeas objects are created by createAugeas() only.
+ */
+NAN_METHOD(LibAugeas::construct) {
+    Nan::ThrowError("Use createAugeas() to create Augeas objects");
+}
+
+/*
+ * Wrapper of aug_close() - frees the augeas handle and the tree
+ * right away instead of waiting for garbage collection.
+ * Any other function throws an exception after that.
+ * Replicas of this handle stay usable, but are not updated any more.
+ * Throws an exception if async operation (e. g. save()) is in progress.
+ * Closing a closed handle does nothing.
+ * Also called by 'using' (index.js installs it as Symbol.dispose,
+ * or Symbol.for('nodejs.dispose') on runtimes without it).
+ */
+NAN_METHOD(LibAugeas::close) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->m_closed) {
+        return;
+    }
+    if (obj->m_inflight > obj->m_copying) {
+        Nan::ThrowError("Cannot close while async operation is in progress");
+        return;
+    }
+
+    obj->m_closed = true;
+    obj->features();
+    obj->detach();
+    // copies for replicas are not needed any more:
+    obj->takeCopies(false);
+    obj->m_vars.clear();
+    obj->m_ops.clear();
+    obj->m_nodesets.clear();
+    obj->m_deadVars.clear();
+    obj->m_deadBack.clear();
+    obj->m_journal.clear();
+    obj->m_journaling = false;
+    obj->m_lazyFiles = LazyFiles();
+    obj->cacheClear();
+    obj->adjustMemory(-obj->m_memory);
+    // a replica being created or replaying operations
+    // is closed in replicaAfter():
+    aug_close(obj->m_aug);
+    obj->m_aug = NULL;
+    if (!obj->m_busy) {
+        aug_close(obj->m_back);
+        obj->m_back = NULL;
+    }
+}
+
+/*
+ * Wrapper of aug_defvar() - define a variable
+ * The second argument is optional and if ommited,
+ * variable will be removed if exists.
+ *
+ * On error, throws an exception and returns undefined;
+ * on success, returns 0 if expr evaluates to anything
+ * other than a nodeset, and the number of nodes if expr
+ * evaluates to a nodeset
+ */
+NAN_METHOD(LibAugeas::defvar) {
+    Nan::HandleScope scope;
+
+    if (info.Length() < 1 || info.Length() > 2) {
+        Nan::ThrowError("Wrong number of arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value n_str(isol(), info[0]);
+    String::Utf8Value e_str(isol(), info[1]);
+
+    const char *name = *n_str;
+    const char *expr = *e_str;
+    OpSpan span("defvar", obj->m_id, expr);
+
+    /* Returns -1 on error; on success, returns 0 if EXPR evaluates to anything
+     * other than a nodeset, and the number of nodes if EXPR evaluates to a
+     * nodeset
+     */
+    AugLock lock(obj);
+    if (!info[1]->IsUndefined()) {
+        obj->touch(expr);
+    }
+    int rc = aug_defvar(obj->m_aug, name, info[1]->IsUndefined() ? NULL : expr);
+    if (-1 == rc) {
+        throw_aug_error_msg(obj->m_aug);
+        Nan::Undefined();
+    } else {
+        obj->record(AugOp(AugOp::DEFVAR, name,
+                          info[1]->IsUndefined() ? "" : expr, "",
+                          info[1]->IsUndefined() ? AugOp::NULL_VALUE : 0));
+        info.GetReturnValue().Set(Nan::New<Number>(rc));
+    }
+}
+
+/*
+ * Wrapper of aug_defnode() - define a node.
+ * The defnode command is very useful when you add a node
+ * that you need to modify further, e. g. by adding children to it.
+ *
+ * On error, throws an exception and returns undefined;
+ * on success, returns the number of nodes in the nodeset (>= 0)
+ *
+ * Arguments:
+ * name - required
+ * expr - required
+ * value - optional
+ * callback - optional
+ *
+ * The last argument could be a function. It will be called (synchronously)
+ * with one argument set to True if a node was created, and False if it already
+ *existed.
+ */
+NAN_METHOD(LibAugeas::defnode) {
+    Nan::HandleScope scope;
+
+    if (info.Length() < 2 || info.Length() > 4) {
+        Nan::ThrowError("Wrong number of arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value n_str(isol(), info[0]);
+    String::Utf8Value e_str(isol(), info[1]);
+    String::Utf8Value v_str(isol(), info[2]);
+
+    const char *name = *n_str;
+    const char *expr = *e_str;
+    const char *value = NULL;
+    if (!info[2]->IsUndefined() && !info[2]->IsFunction()) {
+        value = *v_str;
+    }
+    int created;
+    OpSpan span("defnode", obj->m_id, expr);
+
+    /* Returns -1 on error; on success, returns
+     * the number of nodes in the nodeset, set created=1 if node created,
+     * set created=0 if node already existed.
+     */
+    int rc;
+    {
+        AugLock lock(obj);
+        obj->touch(expr);
+        rc = aug_defnode(obj->m_aug, name, expr, value, &created);
+        if (-1 == rc) {
+            throw_aug_error_msg(obj->m_aug);
+            return;
+        }
+        obj->record(AugOp(AugOp::DEFNODE, name, expr, value ? value : "",
+                          value ? 0 : AugOp::NULL_VALUE));
+    }
+
+    // the callback may use this handle, so not under the lock:
+    int last = info.Length() - 1;
+    if (info[last]->IsFunction()) {
+        Nan::Callback cb(Local<Function>::Cast(info[last]));
+
+        Local<Value> argv[] = { Nan::New<Boolean>(created == 1) };
+
+        Nan::TryCatch try_catch;
+        cb.Call(1, argv);
+        if (try_catch.HasCaught()) {
+            Nan::FatalException(try_catch);
+        }
+    }
+    info.GetReturnValue().Set(Nan::New<Number>(rc));
+}
+
+/*
+ * Helper function.
+ * Sets the result of get() from aug_get(), or throws an exception.
+ *
+ * aug_get() returns 1 if there is exactly one node matching PATH,
+ * 0 if there is none, and a negative value
+ * if there is more than one node matching PATH,
+ * or if PATH is not a legal path expression.
+ *
+ * The string value must not be freed by the caller,
+ * and is valid as long as its node remains unchanged.
+ */
+inline void get_result(const Nan::FunctionCallbackInfo<Value> &info,
+                       augeas *aug, int rc, const char *value) {
+    if (1 == rc) {
+        if (NULL != value) {
+            info.GetReturnValue().Set(Nan::New<String>(value).ToLocalChecked());
+        } else {
+            Nan::Null();
+        }
+    } else if (0 == rc) {
+        Nan::Undefined();
+    } else if (rc < 0) {
+        throw_aug_error_msg(aug);
+        Nan::Undefined();
+    } else {
+        Nan::ThrowError("Unexpected return value of aug_get()");
+        Nan::Undefined();
+    }
+}
+
+/*
+ * Wrapper of aug_get() - get exactly one value
+ */
+NAN_METHOD(LibAugeas::get) {
+    // No Nan::HandleScope in the hottest accessors:
+    // V8 creates a handle scope for every callback anyway.
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    const char *value;
+    if (obj->plain()) {
+        Utf8Arg p_str(info.GetIsolate(), info[0]);
+        int rc = aug_get(obj->m_aug, *p_str, &value);
+        get_result(info, obj->m_aug, rc, value);
+        return;
+    }
+    if (obj->closed()) {
+        return;
+    }
+    Utf8Arg p_str(info.GetIsolate(), info[0]);
+
+    const char *path = *p_str; // operator*() returns C-string
+    OpSpan span("get", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    if (obj->m_caching) {
+        CacheEntry *entry = obj->cached('g', path);
+        if (NULL != entry) {
+            if (1 == entry->rc && !entry->null) {
+                info.GetReturnValue().Set(
+                    Nan::New<String>(entry->value).ToLocalChecked());
+            }
+            return;
+        }
+    }
+    int rc = aug_get(obj->m_aug, path, &value);
+    if (obj->m_caching && (0 == rc || 1 == rc)) {
+        CacheEntry entry;
+        entry.rc = rc;
+        entry.null = (1 != rc || NULL == value);
+        entry.value = entry.null ? "" : value;
+        obj->cacheStore('g', path, entry);
+    }
+    get_result(info, obj->m_aug, rc, value);
+}
+
+/*
+ * Wrapper of aug_set() - set exactly one value
+ * Note: this method (as aug_set) does not write any files,
+ *       it just changes internal tree. To write files use LibAugeas::save()
+ */
+NAN_METHOD(LibAugeas::set) {
+    if (info.Length() != 2) {
+        Nan::ThrowError("Function accepts exactly two arguments");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->plain()) {
+        Utf8Arg p_str(info.GetIsolate(), info[0]);
+        Utf8Arg v_str(info.GetIsolate(), info[1]);
+        if (AUG_NOERROR != aug_set(obj->m_aug, *p_str, *v_str)) {
+            throw_aug_error_msg(obj->m_aug);
+        } else {
+            obj->changed();
+        }
+        return;
+    }
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    Utf8Arg p_str(info.GetIsolate(), info[0]);
+    Utf8Arg v_str(info.GetIsolate(), info[1]);
+
+    const char *path = *p_str;
+    const char *value = *v_str;
+    OpSpan span("set", obj->m_id, path);
+
+    /*
+     * 0 on success, -1 on error. It is an error
+     * if more than one node matches path.
+     */
+    AugLock lock(obj);
+    obj->touch(path);
+    int rc = aug_set(obj->m_aug, path, value);
+    if (AUG_NOERROR != rc) {
+        throw_aug_error_msg(obj->m_aug);
+    } else if (obj->recording()) {
+        obj->record(AugOp(AugOp::SET, path, value));
+    } else {
+        obj->changed();
+    }
+    Nan::Undefined();
+}
+
+/*
+ * Helper function.
+ * Returns value of exactly one node as a Buffer (null if the value is NULL,
+ * undefined if there is no such node). Throws an exception on error.
+ *
+ * The value is copied: aug_get() returns memory owned by augeas,
+ * which is freed as soon as the node changes, so it cannot be
+ * given to JS without copying. But there is no UTF-8 decoding.
+ */
+Local<Value> get_buffer(augeas *aug, const char *path) {
     const char *value;
 
+    int rc = aug_get(aug, path, &value);
+    if (1 == rc) {
+        if (NULL != value) {
+            return Nan::CopyBuffer(value, strlen(value)).ToLocalChecked();
+        }
+        return Nan::Null();
+    } else if (0 == rc) {
+        return Nan::Undefined();
+    }
+    throw_aug_error_msg(aug);
+    return Local<Value>();
+}
+
+/*
+ * Like get(), but returns raw bytes of the value as a Buffer.
+ * Useful for large values (certificates, keys etc.).
+ */
+NAN_METHOD(LibAugeas::getBuffer) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+    OpSpan span("getBuffer", obj->m_id, *p_str);
+
+    AugLock lock(obj);
+    obj->touch(*p_str);
+    Local<Value> value = get_buffer(obj->m_aug, *p_str);
+    if (!value.IsEmpty()) {
+        info.GetReturnValue().Set(value);
+    }
+}
+
+/*
+ * Batched getBuffer(): accepts an array of paths,
+ * returns an array of values.
+ */
+NAN_METHOD(LibAugeas::getBuffers) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1 || !info[0]->IsArray()) {
+        Nan::ThrowError("Function expects an array of paths");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    Local<Array> paths = Local<Array>::Cast(info[0]);
+    OpSpan span("getBuffers", obj->m_id);
+    Local<Array> result = Nan::New<Array>(paths->Length());
+
+    std::vector<std::string> p(paths->Length());
+    for (uint32_t i = 0; i < paths->Length(); ++i) {
+        String::Utf8Value p_str(isol(), paths->Get(ctx(), i).ToLocalChecked());
+        p[i] = *p_str;
+    }
+
+    AugLock lock(obj);
+    for (uint32_t i = 0; i < p.size(); ++i) {
+        obj->touch(p[i]);
+    }
+    for (uint32_t i = 0; i < p.size(); ++i) {
+        Local<Value> value = get_buffer(obj->m_aug, p[i].c_str());
+        if (value.IsEmpty()) {
+            return;
+        }
+        result->Set(ctx(), i, value);
+    }
+
+    info.GetReturnValue().Set(result);
+}
+
+/*
+ * Like set(), but takes the value as a Buffer.
+ * Note: augeas values are C strings, so the value must not contain
+ * zero bytes, otherwise it is truncated at the first zero byte.
+ */
+NAN_METHOD(LibAugeas::setBuffer) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 2 || !node::Buffer::HasInstance(info[1])) {
+        Nan::ThrowError("Function expects path and buffer");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+
+    const char *path = *p_str;
+    std::string value(node::Buffer::Data(info[1]),
+                      node::Buffer::Length(info[1]));
+    OpSpan span("setBuffer", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    int rc = aug_set(obj->m_aug, path, value.c_str());
+    if (AUG_NOERROR != rc) {
+        throw_aug_error_msg(obj->m_aug);
+    } else if (obj->recording()) {
+        obj->record(AugOp(AugOp::SET, path, value));
+    } else {
+        obj->changed();
+    }
+}
+
+/*
+ * Batched setBuffer(): accepts an array of paths
+ * and an array of Buffers of the same length.
+ * Stops and throws an exception at the first failure.
+ * Returns the number of set values.
+ */
+NAN_METHOD(LibAugeas::setBuffers) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 2 || !info[0]->IsArray() || !info[1]->IsArray() ||
+        Local<Array>::Cast(info[0])->Length() !=
+            Local<Array>::Cast(info[1])->Length()) {
+        Nan::ThrowError("Function expects two arrays of the same length: "
+                        "paths and buffers");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    Local<Array> paths = Local<Array>::Cast(info[0]);
+    Local<Array> values = Local<Array>::Cast(info[1]);
+    OpSpan span("setBuffers", obj->m_id);
+
+    // converting paths may call JS (toString()), so not under the lock:
+    std::vector<std::string> p_strs(paths->Length());
+    std::vector<std::string> v_strs(paths->Length());
+    for (uint32_t i = 0; i < paths->Length(); ++i) {
+        Local<Value> v = values->Get(ctx(), i).ToLocalChecked();
+        if (!node::Buffer::HasInstance(v)) {
+            Nan::ThrowError("Function expects an array of buffers");
+            return;
+        }
+        String::Utf8Value p_str(isol(), paths->Get(ctx(), i).ToLocalChecked());
+        p_strs[i] = *p_str;
+        v_strs[i].assign(node::Buffer::Data(v), node::Buffer::Length(v));
+    }
+
+    AugLock lock(obj);
+    for (size_t i = 0; i < p_strs.size(); ++i) {
+        const char *path = p_strs[i].c_str();
+        obj->touch(path);
+        if (AUG_NOERROR != aug_set(obj->m_aug, path, v_strs[i].c_str())) {
+            throw_aug_error_msg(obj->m_aug);
+            return;
+        }
+        if (obj->recording()) {
+            obj->record(AugOp(AugOp::SET, p_strs[i], v_strs[i]));
+        } else {
+            obj->changed();
+        }
+    }
+
+    info.GetReturnValue().Set(
+        Nan::New<Number>(static_cast<double>(p_strs.size())));
+}
+
+/*
+ * Wrapper of aug_setm() - set the value of multiple nodes in one operation
+ * Returns the number of modified nodes on success.
+ */
+NAN_METHOD(LibAugeas::setm) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 3) {
+        Nan::ThrowError("Function accepts exactly three arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value b_str(isol(), info[0]);
+    String::Utf8Value s_str(isol(), info[1]);
+    String::Utf8Value v_str(isol(), info[2]);
+
+    const char *base = *b_str;
+    const char *sub = *s_str;
+    const char *value = *v_str;
+    OpSpan span("setm", obj->m_id, base);
+
+    AugLock lock(obj);
+    obj->touch(base);
+    int rc = aug_setm(obj->m_aug, base, sub, value);
+    if (rc >= 0) {
+        if (obj->recording()) {
+            obj->record(AugOp(AugOp::SETM, base, sub, value));
+        } else {
+            obj->changed();
+        }
+        info.GetReturnValue().Set(Nan::New<Int32>(rc));
+    } else {
+        throw_aug_error_msg(obj->m_aug);
+        Nan::Undefined();
+    }
+}
+
+/*
+ * Wrapper of aug_rm() - remove nodes
+ * Remove path and all its children. Returns the number of entries removed.
+ * All nodes that match PATH, and their descendants, are removed.
+ */
+NAN_METHOD(LibAugeas::rm) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+
+    const char *path = *p_str;
+    OpSpan span("rm", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    int rc = aug_rm(obj->m_aug, path);
+    if (rc >= 0) {
+        if (obj->recording()) {
+            obj->record(AugOp(AugOp::RM, path));
+        } else {
+            obj->changed();
+        }
+        info.GetReturnValue().Set(Nan::New<Number>(rc));
+    } else {
+        throw_aug_error_msg(obj->m_aug);
+        Nan::Undefined();
+    }
+}
+
+/*
+ * Wrapper of aug_mv() - move nodes
+ */
+NAN_METHOD(LibAugeas::mv) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 2) {
+        Nan::ThrowError("Function accepts exactly two arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value src(isol(), info[0]);
+    String::Utf8Value dst(isol(), info[1]);
+
+    const char *source = *src;
+    const char *dest = *dst;
+    OpSpan span("mv", obj->m_id, source);
+
+    /*
+     * 0 on success, -1 on error. It is an error
+     * if more than one node matches path.
+     */
+    AugLock lock(obj);
+    obj->touch(source);
+    obj->touch(dest);
+    int rc = aug_mv(obj->m_aug, source, dest);
+    if (AUG_NOERROR != rc) {
+        throw_aug_error_msg(obj->m_aug);
+    } else if (obj->recording()) {
+        obj->record(AugOp(AugOp::MV, source, dest));
+    } else {
+        obj->changed();
+    }
+    Nan::Undefined();
+}
+
+/*
+ * Wrapper of aug_insert(aug, path, label, 0) - insert 'label' after 'path'
+ */
+NAN_METHOD(LibAugeas::insertAfter) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 2) {
+        Nan::ThrowError("Function accepts exactly two arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+    String::Utf8Value l_str(isol(), info[1]);
+
+    const char *path = *p_str;
+    const char *label = *l_str;
+    OpSpan span("insertAfter", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    int rc = aug_insert(obj->m_aug, path, label, 0);
+    if (AUG_NOERROR != rc) {
+        throw_aug_error_msg(obj->m_aug);
+    } else if (obj->recording()) {
+        obj->record(AugOp(AugOp::INSERT, path, label, "", 0));
+    } else {
+        obj->changed();
+    }
+    Nan::Undefined();
+}
+
+/*
+ * Wrapper of aug_insert(aug, path, label, 1) - insert 'label' before 'path'
+ */
+NAN_METHOD(LibAugeas::insertBefore) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 2) {
+        Nan::ThrowError("Function accepts exactly two arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+    String::Utf8Value l_str(isol(), info[1]);
+
+    const char *path = *p_str;
+    const char *label = *l_str;
+    OpSpan span("insertBefore", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    int rc = aug_insert(obj->m_aug, path, label, 1);
+    if (AUG_NOERROR != rc) {
+        throw_aug_error_msg(obj->m_aug);
+    } else if (obj->recording()) {
+        obj->record(AugOp(AugOp::INSERT, path, label, "", AugOp::BEFORE));
+    } else {
+        obj->changed();
+    }
+    Nan::Undefined();
+}
+
+/*
+ * Wrapper of aug_error()
+ * Returns the error code from the last API call
+ */
+NAN_METHOD(LibAugeas::error) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    AugLock lock(obj);
+
+    int rc = aug_error(obj->m_aug);
+    info.GetReturnValue().Set(Nan::New<Int32>(rc));
+}
+
+/*
+ * Returns the error message from the last API call,
+ * including all details.
+ */
+NAN_METHOD(LibAugeas::errorMsg) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    AugLock lock(obj);
+
+    info.GetReturnValue().Set(
+        Nan::New<String>(aug_error_msg(obj->m_aug)).ToLocalChecked());
+}
+
+/*
+ * Returns the lens load error message
+ */
+NAN_METHOD(LibAugeas::errorLens) {
+    Nan::HandleScope scope;
+    const char *val;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function expects lens argument");
+        Nan::Undefined();
+    }
+    String::Utf8Value lens(isol(), info[0]);
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    AugLock lock(obj);
+
+    std::string errPath = "/augeas/load/" + std::string(*lens) + "/error";
+    if (aug_get(obj->m_aug, errPath.c_str(), &val)) {
+        info.GetReturnValue().Set(Nan::New<String>(val).ToLocalChecked());
+    }
+
+    Nan::Undefined();
+}
+
+/*
+ * Returns the incl parsed error message
+ */
+NAN_METHOD(LibAugeas::errorIncl) {
+    Nan::HandleScope scope;
+    int mres;
+    const char *val;
+    char **matches = NULL;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function expects incl argument");
+        Nan::Undefined();
+    }
+    String::Utf8Value incl(isol(), info[0]);
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    AugLock lock(obj);
+
+    std::string errPath = "/augeas/files" + std::string(*incl) + "/error";
+    mres = aug_match(obj->m_aug, errPath.c_str(), &matches);
+    if (mres) {
+        Local<Object> res = Nan::New<Object>();
+
+        if (aug_get(obj->m_aug, std::string(errPath + "/line").c_str(), &val)) {
+            res->Set(ctx(), Nan::New<String>("line").ToLocalChecked(),
+                     Nan::New<String>(val).ToLocalChecked());
+        }
+        if (aug_get(obj->m_aug, std::string(errPath + "/message").c_str(),
+                    &val)) {
+            res->Set(ctx(), Nan::New<String>("message").ToLocalChecked(),
+                     Nan::New<String>(val).ToLocalChecked());
+        }
+        info.GetReturnValue().Set(res);
+    }
+    free_matches(matches, mres);
+
+    Nan::Undefined();
+}
+
+/*
+ * Returns all load errors at once.
+ *
+ * Instead of probing every file with errorIncl() or every lens with
+ * errorLens(), this function walks '/augeas//error' natively and
+ * returns an array of objects, one per error node:
+ *
+ * { file: '/etc/sudoers', lens: '@Sudoers', error: 'parse_failed',
+ *   line: '12', char: '0', message: 'Get did not match entire input' }
+ *
+ * Errors not related to a file (e. g. a transform with a bad lens)
+ * have 'path' (the path of the error node) instead of 'file'.
+ * Every child of the error node is reported under its own label.
+ */
+NAN_METHOD(LibAugeas::loadErrors) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    AugLock lock(obj);
+    OpSpan span("loadErrors", obj->m_id);
+
+    char **errors = NULL;
+    int nerrors = aug_match(obj->m_aug, "/augeas//error", &errors);
+    if (nerrors < 0) {
+        throw_aug_error_msg(obj->m_aug);
+        return;
+    }
+
+    char **details = NULL;
+    int ndetails = aug_match(obj->m_aug, "/augeas//error/*", &details);
+    if (ndetails < 0) {
+        free_matches(errors, nerrors);
+        throw_aug_error_msg(obj->m_aug);
+        return;
+    }
+
+    const std::string filesPrefix = "/augeas/files";
+    const char *val;
+
+    Local<Array> result = Nan::New<Array>(nerrors);
+    std::map<std::string, Local<Object> > byPath;
+
+    for (int i = 0; i < nerrors; ++i) {
+        std::string errPath = errors[i];
+        Local<Object> err = Nan::New<Object>();
+
+        std::string owner = errPath.substr(0, errPath.rfind('/'));
+        if (owner.compare(0, filesPrefix.length(), filesPrefix) == 0) {
+            err->Set(ctx(), Nan::New<String>("file").ToLocalChecked(),
+                     Nan::New<String>(owner.substr(filesPrefix.length()))
+                         .ToLocalChecked());
+            if (1 == aug_get(obj->m_aug, (owner + "/lens").c_str(), &val) &&
+                NULL != val) {
+                err->Set(ctx(), Nan::New<String>("lens").ToLocalChecked(),
+                         Nan::New<String>(val).ToLocalChecked());
+            }
+        } else {
+            err->Set(ctx(), Nan::New<String>("path").ToLocalChecked(),
+                     Nan::New<String>(errPath).ToLocalChecked());
+        }
+
+        if (1 == aug_get(obj->m_aug, errors[i], &val) && NULL != val) {
+            err->Set(ctx(), Nan::New<String>("error").ToLocalChecked(),
+                     Nan::New<String>(val).ToLocalChecked());
+        }
+
+        byPath[errPath] = err;
+        result->Set(ctx(), Nan::New<Number>(i), err);
+    }
+
+    for (int i = 0; i < ndetails; ++i) {
+        std::string detail = details[i];
+        std::string parent = detail.substr(0, detail.rfind('/'));
+        std::map<std::string, Local<Object> >::iterator it =
+            byPath.find(parent);
+        if (it == byPath.end() ||
+            1 != aug_get(obj->m_aug, details[i], &val) || NULL == val) {
+            continue;
+        }
+        std::string label = path_label(detail);
+        // keep the lens name of the file, it is more useful than lens info:
+        if (label == "lens" &&
+            it->second->Has(ctx(), Nan::New<String>("lens").ToLocalChecked())
+                .FromMaybe(false)) {
+            continue;
+        }
+        it->second->Set(ctx(), Nan::New<String>(label).ToLocalChecked(),
+                        Nan::New<String>(val).ToLocalChecked());
+    }
+
+    free_matches(errors, nerrors);
+    free_matches(details, ndetails);
+
+    info.GetReturnValue().Set(result);
+}
+
+struct SaveUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    int rc; // = aug_save(), 0 on success, -1 on error
+    AsyncTimes times;
+};
+
+void saveWork(uv_work_t *req) {
+    SaveUV *suv = static_cast<SaveUV *>(req->data);
+    AugLock lock(suv->obj, true);
+    suv->times.started = uv_hrtime();
+    suv->rc = aug_save(suv->aug);
+    suv->times.finished = uv_hrtime();
+}
+
+/*
+ * Execute JS callback after saveWork() terminated
+ */
+void saveAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    SaveUV *suv = static_cast<SaveUV *>(req->data);
+    Local<Value> argv[] = { Nan::New<Int32>(suv->rc) };
+
+    suv->obj->inflight(-1);
+    if (AUG_NOERROR == suv->rc) {
+        suv->obj->saved();
+    }
+    // saving changes /augeas/events and /augeas/files:
+    suv->obj->invalidate("/augeas");
+    if (tracing()) {
+        trace("save", suv->obj->id(), "",
+              aug_match(suv->aug, "/augeas/events/saved", NULL),
+              suv->times.queued, suv->times.started, suv->times.finished);
+    }
+    suv->handle.Reset();
+
+    Nan::TryCatch try_catch;
+    suv->callback.Call(1, argv);
+    delete suv;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Wrapper of aug_save() - save changed files.
+ *
+ * Without arguments this function performs blocking saving
+ * and throws an exception on error.
+ *
+ * The only argument allowed is a callback function.
+ * If such an argument is given this function performs
+ * non-blocking (async) saving, and after saving is done (or failed)
+ * executes the callback with one integer argument - return value of aug_save(),
+ * i. e. 0 on success, -1 on failure.
+ *
+ * Other calls on the handle made while saving (including another
+ * async save) wait until saving is done.
+ *
+ * Always returns undefined.
+ */
+NAN_METHOD(LibAugeas::save) {
+    Nan::HandleScope scope;
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+
+    // if no info, save files synchronously (blocking):
+    if (info.Length() == 0) {
+        OpSpan span("save", obj->m_id);
+        AugLock lock(obj);
+        int rc = aug_save(obj->m_aug);
+        if (AUG_NOERROR != rc) {
+            Nan::ThrowError("Failed to write files");
+        } else {
+            obj->saved();
+        }
+        obj->invalidate("/augeas");
+        if (span.active()) {
+            span.files(aug_match(obj->m_aug, "/augeas/events/saved", NULL));
+        }
+        // single argument is a function - async:
+    } else if ((info.Length() == 1) && info[0]->IsFunction()) {
+        SaveUV *suv = new SaveUV();
+        suv->request.data = suv;
+        suv->obj = obj;
+        suv->aug = obj->m_aug;
+        suv->handle.Reset(info.This());
+        suv->callback.SetFunction(Local<Function>::Cast(info[0]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &suv->request, saveWork,
+                      (uv_after_work_cb)saveAfter);
+    } else {
+        Nan::ThrowError("Callback function or nothing");
+    }
+
+    Nan::Undefined();
+}
+
+/*
+ * The result of saving one file by saveFiles().
+ */
+struct FileSave {
+    std::string path; // file node, e. g. "/files/etc/hosts"
+    bool saved;       // listed in /augeas/events/saved
+    std::string error;
+
+    FileSave(const std::string &p) : path(p), saved(false) {}
+};
+
+/*
+ * Helper function.
+ * Returns file name of file node path without "/files"
+ * and escapes ("/files/etc/a\ b" -> "/etc/a b").
+ */
+std::string file_name(const std::string &path) {
+    std::string file;
+    for (size_t i = strlen("/files"); i < path.length(); ++i) {
+        if ('\\' == path[i] && i + 1 < path.length()) {
+            ++i;
+        }
+        file.push_back(path[i]);
+    }
+    return file;
+}
+
+/*
+ * Helper function.
+ * Escapes glob characters, so that the glob matches only file.
+ */
+std::string glob_escape(const std::string &file) {
+    std::string glob;
+    for (size_t i = 0; i < file.length(); ++i) {
+        if (strchr("*?[]\\", file[i]) != NULL) {
+            glob.push_back('\\');
+        }
+        glob.push_back(file[i]);
+    }
+    return glob;
+}
+
+/*
+ * Helper function.
+ * Whether a transform with incl and excl globs loads file.
+ */
+bool xfm_applies(const std::vector<std::string> &incl,
+                 const std::vector<std::string> &excl,
+                 const std::string &file) {
+    bool included = false;
+    for (size_t i = 0; i < incl.size() && !included; ++i) {
+        included = incl_matches(incl[i], file);
+    }
+    for (size_t i = 0; i < excl.size() && included; ++i) {
+        included = !excl_matches(excl[i], file);
+    }
+    return included;
+}
+
+// Entries of /augeas/files moved aside by save_files(), in the scratch
+// subtree:
+static const char HOLD_NODE[] = "/augeas/binding/hold";
+
+/*
+ * Helper function.
+ * Saves only the given files with aug_save(), so that augeas does
+ * the writing with all its /augeas/save options. aug_save() writes
+ * every modified file some transform applies to, removes files whose
+ * nodes were removed, and then marks the whole tree as saved.
+ * So for the duration of the call:
+ *
+ * - incl globs of every transform are replaced with names
+ *   of the given files it applies to;
+ * - entries of other removed files are moved from /augeas/files
+ *   to HOLD_NODE.
+ *
+ * Other files which would be saved are found by aug_save() in 'noop'
+ * mode first, and are marked modified again afterwards.
+ * Returns the value of aug_save().
+ */
+int save_files(augeas *aug, std::vector<FileSave> &files) {
+    const char *val;
+    std::string mode = "overwrite";
+    if (1 == aug_get(aug, "/augeas/save", &val) && NULL != val) {
+        mode = val;
+    }
+    std::set<std::string> paths;
+    for (size_t i = 0; i < files.size(); ++i) {
+        paths.insert(files[i].path);
+    }
+
+    // other removed files:
+    std::vector<std::string> held;
+    char **entries = NULL;
+    int nentries = aug_match(aug, "/augeas/files//path[../mtime]", &entries);
+    for (int i = 0; i < nentries; ++i) {
+        if (1 != aug_get(aug, entries[i], &val) || NULL == val ||
+            paths.count(val) > 0 || aug_match(aug, val, NULL) != 0) {
+            continue;
+        }
+        std::string entry(entries[i], strlen(entries[i]) - strlen("/path"));
+        std::string hold = HOLD_NODE + std::string("/") +
+                           std::to_string(held.size());
+        if (0 == aug_mv(aug, entry.c_str(), hold.c_str())) {
+            held.push_back(entry);
+        }
+    }
+    free_matches(entries, nentries);
+
+    std::vector<std::string> modified;
+    if ("noop" != mode) {
+        aug_set(aug, "/augeas/save", "noop");
+        aug_save(aug);
+        modified = get_values(aug, "/augeas/events/saved");
+        aug_set(aug, "/augeas/save", mode.c_str());
+    }
+
+    // transform => its incl globs:
+    std::map<std::string, std::vector<std::string> > incl;
+    char **xfms = NULL;
+    int nxfms = aug_match(aug, "/augeas/load/*", &xfms);
+    for (int i = 0; i < nxfms; ++i) {
+        std::string xfm = xfms[i];
+        std::vector<std::string> excl = get_values(aug, xfm + "/excl");
+        incl[xfm] = get_values(aug, xfm + "/incl");
+        aug_rm(aug, (xfm + "/incl").c_str());
+        for (size_t j = 0; j < files.size(); ++j) {
+            std::string file = file_name(files[j].path);
+            if (xfm_applies(incl[xfm], excl, file)) {
+                aug_set(aug, (xfm + "/incl[last()+1]").c_str(),
+                        glob_escape(file).c_str());
+            }
+        }
+    }
+    free_matches(xfms, nxfms);
+
+    int rc = aug_save(aug);
+
+    std::vector<std::string> events = get_values(aug, "/augeas/events/saved");
+    std::set<std::string> saved(events.begin(), events.end());
+    for (size_t i = 0; i < files.size(); ++i) {
+        FileSave &fs = files[i];
+        std::string info = "/augeas/files" + fs.path.substr(strlen("/files"));
+        fs.saved = saved.count(fs.path) > 0;
+        if (1 == aug_get(aug, (info + "/error/message").c_str(), &val) &&
+            NULL != val) {
+            fs.error = val;
+        } else if (1 == aug_get(aug, (info + "/error").c_str(), &val) &&
+                   NULL != val) {
+            fs.error = val;
+        } else if (0 == aug_match(aug, fs.path.c_str(), NULL) &&
+                   0 == aug_match(aug, info.c_str(), NULL)) {
+            fs.error = "No file at " + fs.path;
+        }
+    }
+
+    // restore:
+    for (size_t i = 0; i < held.size(); ++i) {
+        std::string hold = HOLD_NODE + std::string("/") + std::to_string(i);
+        aug_mv(aug, hold.c_str(), held[i].c_str());
+    }
+    aug_rm(aug, SCRATCH_NODE);
+    for (std::map<std::string, std::vector<std::string> >::iterator it =
+             incl.begin();
+         it != incl.end(); ++it) {
+        aug_rm(aug, (it->first + "/incl").c_str());
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            aug_set(aug, (it->first + "/incl[last()+1]").c_str(),
+                    it->second[i].c_str());
+        }
+    }
+    // a child added and removed makes the file modified:
+    for (size_t i = 0; i < modified.size(); ++i) {
+        if (paths.count(modified[i]) == 0) {
+            std::string tmp = modified[i] + "/augeas-modified";
+            aug_set(aug, tmp.c_str(), NULL);
+            aug_rm(aug, tmp.c_str());
+        }
+    }
+
+    for (size_t i = 0; i < files.size() && AUG_NOERROR == rc; ++i) {
+        if (!files[i].error.empty()) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Returns an array of { path, saved[, error] }.
+ */
+Local<Array> file_saves(const std::vector<FileSave> &files) {
+    Local<Array> res = Nan::New<Array>(static_cast<int>(files.size()));
+    for (size_t i = 0; i < files.size(); ++i) {
+        Local<Object> o = Nan::New<Object>();
+        o->Set(ctx(), Nan::New<String>("path").ToLocalChecked(),
+               Nan::New<String>(files[i].path).ToLocalChecked());
+        o->Set(ctx(), Nan::New<String>("saved").ToLocalChecked(),
+               Nan::New<Boolean>(files[i].saved));
+        if (!files[i].error.empty()) {
+            o->Set(ctx(), Nan::New<String>("error").ToLocalChecked(),
+                   Nan::New<String>(files[i].error).ToLocalChecked());
+        }
+        res->Set(ctx(), i, o);
+    }
+    return res;
+}
+
+inline int saved_count(const std::vector<FileSave> &files) {
+    int n = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        n += files[i].saved ? 1 : 0;
+    }
+    return n;
+}
+
+struct SaveFilesUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    std::vector<FileSave> files;
+    int rc;
+    AsyncTimes times;
+};
+
+void LibAugeas::saveFilesWork(uv_work_t *req) {
+    SaveFilesUV *suv = static_cast<SaveFilesUV *>(req->data);
+    AugLock lock(suv->obj, true);
+    suv->times.started = uv_hrtime();
+    suv->rc = save_files(suv->aug, suv->files);
+    suv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::saveFilesAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    SaveFilesUV *suv = static_cast<SaveFilesUV *>(req->data);
+    suv->obj->inflight(-1);
+    // saving changes /augeas/events and /augeas/files:
+    suv->obj->invalidate("/augeas");
+    trace("saveFiles", suv->obj->id(), "", saved_count(suv->files),
+          suv->times.queued, suv->times.started, suv->times.finished);
+    Local<Value> argv[] = { Nan::New<Int32>(suv->rc), file_saves(suv->files) };
+
+    Nan::TryCatch try_catch;
+    suv->callback.Call(2, argv);
+    suv->handle.Reset();
+    delete suv;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Saves only the given files, e. g.
+ *
+ * aug.saveFiles(['/files/etc/hosts'], function(rc, results) {...})
+ *
+ * Unlike save() other files are not written: files are saved by aug_save()
+ * with transforms limited to the given files (see save_files()),
+ * so /augeas/save and the rest are handled by augeas itself. Other
+ * modified files are rendered once to find out whether they differ from
+ * disk, and stay modified in the tree, so that a later save() writes them.
+ * Paths are file nodes ("/files/etc/hosts") or file names ("/etc/hosts").
+ * 'saved' is true if the file is listed in /augeas/events/saved,
+ * i. e. it was written or removed (or would be in 'noop' mode).
+ *
+ * Results are an array of objects like
+ * { path: '/files/etc/hosts', saved: true } or
+ * { path: '/files/etc/hosts', saved: false, error: '...' }.
+ *
+ * Without callback files are saved synchronously and results are returned.
+ * With callback files are saved on the threadpool and the callback
+ * is executed with two arguments: 0 if all files are saved (-1 otherwise)
+ * and results.
+ */
+NAN_METHOD(LibAugeas::saveFiles) {
+    Nan::HandleScope scope;
+
+    if (info.Length() < 1 || info.Length() > 2 ||
+        (info.Length() == 2 && !info[1]->IsFunction())) {
+        Nan::ThrowError("Function expects paths and optional callback");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+
+    std::vector<std::string> paths;
+    if (info[0]->IsArray()) {
+        Local<Array> a = Local<Array>::Cast(info[0]);
+        for (uint32_t i = 0; i < a->Length(); ++i) {
+            String::Utf8Value p_str(isol(), a->Get(ctx(), i).ToLocalChecked());
+            paths.push_back(*p_str);
+        }
+    } else {
+        String::Utf8Value p_str(isol(), info[0]);
+        paths.push_back(*p_str);
+    }
+
+    std::vector<FileSave> files;
+    AugLock lock(obj);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::string path = paths[i];
+        if (0 != path.compare(0, 7, "/files/")) {
+            path = "/files" + path;
+        }
+        obj->touch(path);
+        files.push_back(FileSave(path));
+    }
+
+    if (info.Length() == 2) {
+        SaveFilesUV *suv = new SaveFilesUV();
+        suv->request.data = suv;
+        suv->obj = obj;
+        suv->aug = obj->m_aug;
+        suv->files.swap(files);
+        suv->handle.Reset(info.This());
+        suv->callback.SetFunction(Local<Function>::Cast(info[1]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &suv->request, saveFilesWork,
+                      (uv_after_work_cb)saveFilesAfter);
+        return;
+    }
+
+    OpSpan span("saveFiles", obj->m_id);
+    save_files(obj->m_aug, files);
+    obj->invalidate("/augeas");
+    span.files(saved_count(files));
+    info.GetReturnValue().Set(file_saves(files));
+}
+
+/*
+ * Wrapper of aug_match(aug, path, NULL) - count all nodes matching path
+ * expression
+ * Returns the number of found nodes.
+ * Note: aug_match() allocates memory if the third argument is not NULL,
+ * in this function we always set it to NULL and get only number of found nodes.
+ */
+NAN_METHOD(LibAugeas::nmatch) {
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    Utf8Arg p_str(info.GetIsolate(), info[0]);
+
+    const char *path = *p_str;
+    OpSpan span("nmatch", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    if (obj->m_caching) {
+        CacheEntry *entry = obj->cached('n', path);
+        if (NULL != entry) {
+            info.GetReturnValue().Set(Nan::New<Number>(entry->rc));
+            return;
+        }
+    }
+    int rc = aug_match(obj->m_aug, path, NULL);
+    if (rc >= 0) {
+        if (obj->m_caching) {
+            CacheEntry entry;
+            entry.rc = rc;
+            obj->cacheStore('n', path, entry);
+        }
+        info.GetReturnValue().Set(Nan::New<Number>(rc));
+    } else {
+        throw_aug_error_msg(obj->m_aug);
+        Nan::Undefined();
+    }
+}
+
+/*
+ * Helper function.
+ * Converts result of aug_match() into an array and frees it,
+ * copying the paths into *paths unless it is NULL.
+ */
+Local<Array> match_array(char **matches, int n,
+                         std::vector<std::string> *paths) {
+    Local<Array> result = Nan::New<Array>(n);
+    if (NULL == matches) {
+        return result;
+    }
+    for (int i = 0; i < n; ++i) {
+        result->Set(ctx(), Nan::New<Number>(i),
+                    Nan::New<String>(matches[i]).ToLocalChecked());
+        if (NULL != paths) {
+            paths->push_back(matches[i]);
+        }
+        free(matches[i]);
+    }
+    free(matches);
+    return result;
+}
+
+/*
+ * Wrapper of aug_match(, , non-NULL).
+ * Returns an array of nodes matching given path expression
+ */
+NAN_METHOD(LibAugeas::match) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    char **matches = NULL;
+    if (obj->plain()) {
+        String::Utf8Value p_str(isol(), info[0]);
+        int rc = aug_match(obj->m_aug, *p_str, &matches);
+        if (rc >= 0) {
+            info.GetReturnValue().Set(match_array(matches, rc, NULL));
+        } else {
+            throw_aug_error_msg(obj->m_aug);
+        }
+        return;
+    }
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value p_str(isol(), info[0]);
+
+    const char *path = *p_str;
+    OpSpan span("match", obj->m_id, path);
+
+    AugLock lock(obj);
+    obj->touch(path);
+    if (obj->m_caching) {
+        CacheEntry *entry = obj->cached('m', path);
+        if (NULL != entry) {
+            Local<Array> result = Nan::New<Array>(entry->rc);
+            for (int i = 0; i < entry->rc; ++i) {
+                result->Set(ctx(), i,
+                            Nan::New<String>(entry->paths[i]).ToLocalChecked());
+            }
+            info.GetReturnValue().Set(result);
+            return;
+        }
+    }
+    int rc = aug_match(obj->m_aug, path, &matches);
+    if (rc >= 0) {
+        CacheEntry entry;
+        info.GetReturnValue().Set(match_array(
+            matches, rc, obj->m_caching ? &entry.paths : NULL));
+        if (obj->m_caching) {
+            entry.rc = rc;
+            obj->cacheStore('m', path, entry);
+        }
+    } else {
+        throw_aug_error_msg(obj->m_aug);
+        Nan::Undefined();
+    }
+}
+
+/*
+ * Step of path expression: separator ("", "/" or "//"),
+ * the step itself and its predicates, e. g. "//", "ipaddr"
+ * and "[. = '127.0.0.1']" for "//ipaddr[. = '127.0.0.1']".
+ */
+struct PathStep {
+    std::string sep;
+    std::string base;
+    std::vector<std::string> preds;
+};
+
+/*
+ * Helper function.
+ * Splits path expression into steps. '/' and '[' inside predicates,
+ * parentheses and string literals, or escaped with '\' in labels
+ * ('/files/etc/a\/b'), are not special.
+ * Returns false for a union ('|' outside predicates),
+ * which cannot be split into steps.
+ */
+bool split_path(const std::string &expr, std::vector<PathStep> &steps) {
+    PathStep step;
+    std::string *cur = &step.base;
+    int depth = 0;
+    char quote = 0;
+
+    steps.clear();
+    for (size_t i = 0; i < expr.length(); ++i) {
+        char c = expr[i];
+        if (0 != quote) {
+            if (c == quote) {
+                quote = 0;
+            }
+        } else if ('\\' == c && i + 1 < expr.length()) {
+            // the escaped character is part of the label:
+            cur->push_back(c);
+            c = expr[++i];
+        } else if ('\'' == c || '"' == c) {
+            quote = c;
+        } else if ('(' == c) {
+            ++depth;
+        } else if (')' == c) {
+            --depth;
+        } else if ('[' == c) {
+            if (0 == depth) {
+                step.preds.push_back(std::string());
+                cur = &step.preds.back();
+            }
+            ++depth;
+        } else if (']' == c) {
+            --depth;
+        } else if (0 == depth && '|' == c) {
+            return false;
+        } else if (0 == depth && '/' == c) {
+            if (!step.base.empty() || !step.preds.empty()) {
+                steps.push_back(step);
+                step = PathStep();
+            }
+            step.sep.push_back(c);
+            cur = &step.base;
+            continue;
+        }
+        cur->push_back(c);
+    }
+    if (!step.sep.empty() || !step.base.empty()) {
+        steps.push_back(step);
+    }
+    return true;
+}
+
+/*
+ * Returns a warning if the step scans all descendants, or empty string.
+ * nodes - the number of context nodes, -1 for the first step.
+ */
+std::string descendant_warning(const PathStep &step, int nodes) {
+    if ("//" != step.sep && 0 != step.base.find("descendant")) {
+        return std::string();
+    }
+    std::string msg = "Step '" + step.sep + step.base + "' scans ";
+    if (nodes < 0) {
+        return msg + "the whole tree";
+    }
+    return msg + "all descendants of " + std::to_string(nodes) + " nodes";
+}
+
+/*
+ * Profiles path expression: evaluates it step by step and reports
+ * the number of nodes and the time of each step and each predicate.
+ * Returns an object like:
+ *
+ * { expr: '/files/etc/services/service-name[. = "ssh"]/port',
+ *   count: 2, ms: 0.8,
+ *   steps: [ { step: '/files', expr: '/files', count: 1, ms: 0.002, delta: 0.002 },
+ *            ...
+ *            { step: '[. = "ssh"]',
+ *              expr: '/files/etc/services/service-name[. = "ssh"]',
+ *              count: 2, ms: 0.7, delta: 0.5 },
+ *            ... ],
+ *   warnings: [] }
+ *
+ * 'count' and 'ms' of the whole expression are those of aug_match().
+ * Each step is evaluated on the nodeset of the previous step, so 'ms' of
+ * a step does not include previous steps. 'ms' of a predicate includes
+ * the step and the predicates before it, 'delta' is the cost of the
+ * predicate itself. A warning is given for each step scanning all
+ * descendants ('//' or descendant axis), and for '//' inside predicates
+ * or functions. A union is profiled as a whole.
+ *
+ * Nodesets are kept in the variables 'explain<N>a' and 'explain<N>b',
+ * which are undefined afterwards.
+ */
+NAN_METHOD(LibAugeas::explain) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value e_str(isol(), info[0]);
+
+    std::string expr = *e_str;
+    OpSpan span("explain", obj->m_id, *e_str);
+
+    AugLock lock(obj);
+    obj->touch(expr);
+
+    uint64_t start = uv_hrtime();
+    int count = aug_match(obj->m_aug, expr.c_str(), NULL);
+    uint64_t total = uv_hrtime() - start;
+    if (count < 0) {
+        throw_aug_error_msg(obj->m_aug);
+        return;
+    }
+
+    Local<Array> warnings = Nan::New<Array>();
+    std::vector<PathStep> steps;
+    if (!split_path(expr, steps)) {
+        steps.assign(1, PathStep());
+        steps[0].base = expr;
+        warnings->Set(ctx(), warnings->Length(),
+                      Nan::New<String>("Union is profiled as a whole")
+                          .ToLocalChecked());
+    }
+
+    // unique, so that variables defined by the user are not overwritten:
+    static unsigned int lastVar = 0;
+    std::string var = "explain" + std::to_string(++lastVar);
+    const std::string vars[] = { var + "a", var + "b" };
+    Local<Array> result = Nan::New<Array>();
+    std::string prefix; // steps evaluated so far
+    int nodes = -1;     // the number of nodes of the previous step
+
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const PathStep &st = steps[i];
+        std::string warning = descendant_warning(st, nodes);
+        if (!warning.empty()) {
+            warnings->Set(ctx(), warnings->Length(),
+                          Nan::New<String>(warning).ToLocalChecked());
+        }
+
+        std::string e = (0 == i) ? std::string()
+                                 : "$" + vars[(i - 1) % 2];
+        e += st.sep + st.base;
+        prefix += st.sep + st.base;
+
+        double prev = 0;
+        for (size_t j = 0; j <= st.preds.size(); ++j) {
+            if (j > 0) {
+                e += st.preds[j - 1];
+                prefix += st.preds[j - 1];
+            }
+            // the whole step is kept for the next one:
+            start = uv_hrtime();
+            int rc = (j == st.preds.size())
+                         ? aug_defvar(obj->m_aug, vars[i % 2].c_str(),
+                                      e.c_str())
+                         : aug_match(obj->m_aug, e.c_str(), NULL);
+            double t = ms(uv_hrtime() - start);
+            if (rc < 0) {
+                std::string msg = "Failed to evaluate '" + prefix + "': " +
+                                  aug_error_msg(obj->m_aug);
+                aug_defvar(obj->m_aug, vars[0].c_str(), NULL);
+                aug_defvar(obj->m_aug, vars[1].c_str(), NULL);
+                Nan::ThrowError(msg.c_str());
+                return;
+            }
+
+            Local<Object> step = Nan::New<Object>();
+            step->Set(ctx(), Nan::New<String>("step").ToLocalChecked(),
+                      Nan::New<String>(j > 0 ? st.preds[j - 1]
+                                             : st.sep + st.base)
+                          .ToLocalChecked());
+            step->Set(ctx(), Nan::New<String>("expr").ToLocalChecked(),
+                      Nan::New<String>(prefix).ToLocalChecked());
+            step->Set(ctx(), Nan::New<String>("count").ToLocalChecked(),
+                      Nan::New<Int32>(rc));
+            step->Set(ctx(), Nan::New<String>("ms").ToLocalChecked(),
+                      Nan::New<Number>(t));
+            step->Set(ctx(), Nan::New<String>("delta").ToLocalChecked(),
+                      Nan::New<Number>(t > prev ? t - prev : 0));
+            result->Set(ctx(), result->Length(), step);
+
+            prev = t;
+            nodes = rc;
+        }
+    }
+    aug_defvar(obj->m_aug, vars[0].c_str(), NULL);
+    aug_defvar(obj->m_aug, vars[1].c_str(), NULL);
+
+    if (0 == warnings->Length() && expr.find("//") != std::string::npos) {
+        warnings->Set(ctx(), 0,
+                      Nan::New<String>("'//' in a predicate or function "
+                                       "scans all descendants")
+                          .ToLocalChecked());
+    }
+
+    Local<Object> res = Nan::New<Object>();
+    res->Set(ctx(), Nan::New<String>("expr").ToLocalChecked(),
+             Nan::New<String>(expr).ToLocalChecked());
+    res->Set(ctx(), Nan::New<String>("count").ToLocalChecked(),
+             Nan::New<Int32>(count));
+    res->Set(ctx(), Nan::New<String>("ms").ToLocalChecked(),
+             Nan::New<Number>(ms(total)));
+    res->Set(ctx(), Nan::New<String>("steps").ToLocalChecked(), result);
+    res->Set(ctx(), Nan::New<String>("warnings").ToLocalChecked(), warnings);
+    info.GetReturnValue().Set(res);
+}
+
+/*
+ * Evaluates path expression and returns the nodeset as an object
+ * with the following functions:
+ *
+ * count() - the number of nodes,
+ * get(i) - { label: 'alias', value: 'localhost', index: 2 } of node #i
+ *          (index is the position among siblings with the same label,
+ *          as in '/files/etc/hosts/1/alias[2]'),
+ * label(i), value(i), path(i) - label, value or path of node #i,
+ * entries() - array of get(i) for all nodes,
+ * free() - forget the nodeset, it is also forgotten when garbage
+ *          collected.
+ *
+ * Nodes are accessed directly, so iterating over 10k children does not
+ * evaluate 10k paths, as match() followed by get() does. The nodeset
+ * is not updated when the tree changes, except that removed nodes are
+ * dropped from it. On a replica the expression is evaluated again
+ * when the replica catches up with the primary. The nodeset keeps
+ * this object alive.
+ *
+ * Wrapper of aug_defvar() and aug_ns_*(), the variable is named
+ * 'nodeset<N>'.
+ */
+NAN_METHOD(LibAugeas::nodeset) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value e_str(isol(), info[0]);
+
+    const char *expr = *e_str;
+    OpSpan span("nodeset", obj->m_id, expr);
+    static unsigned int lastVar = 0;
+    std::string var = "nodeset" + std::to_string(++lastVar);
+
+    AugLock lock(obj);
+    obj->touch(expr);
+    if (aug_defvar(obj->m_aug, var.c_str(), expr) < 0) {
+        throw_aug_error_msg(obj->m_aug);
+        return;
+    }
+    obj->m_nodesets[var] = expr;
+    info.GetReturnValue().Set(AugNodeset::New(info.This(), var));
+}
+
+Nan::Persistent<FunctionTemplate> AugNodeset::nodesetTemplate;
+
+void AugNodeset::Init(Handle<Object> target) {
+    Nan::HandleScope scope;
+
+    Local<FunctionTemplate> localTemplate = Nan::New<v8::FunctionTemplate>();
+    nodesetTemplate.Reset(localTemplate);
+    localTemplate->SetClassName(Nan::New<String>("Nodeset").ToLocalChecked());
+    localTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+    _NEW_METHOD(count);
+    _NEW_METHOD(get);
+    _NEW_METHOD(label);
+    _NEW_METHOD(value);
+    _NEW_METHOD(path);
+    _NEW_METHOD(entries);
+    _NEW_METHOD(free);
+
+    target->Set(ctx(), Nan::New<String>("Nodeset").ToLocalChecked(),
+                localTemplate->GetFunction(ctx()).ToLocalChecked());
+}
+
+Local<Object> AugNodeset::New(Local<Object> handle, const std::string &var) {
+    AugNodeset *ns = new AugNodeset();
+    ns->m_handle.Reset(handle);
+    ns->m_obj = node::ObjectWrap::Unwrap<LibAugeas>(handle);
+    ns->m_var = var;
+    Local<FunctionTemplate> localTemplate = Nan::New(nodesetTemplate);
+    Local<Object> O = localTemplate->InstanceTemplate()->NewInstance(ctx()).ToLocalChecked();
+    ns->Wrap(O);
+    return O;
+}
+
+AugNodeset::~AugNodeset() {
+    // see LibAugeas::undefine():
+    if (!m_var.empty() && !m_obj->m_closed) {
+        m_obj->m_deadVars.push_back(m_var);
+        m_obj->features();
+    }
+    m_handle.Reset();
+}
+
+/*
+ * Returns the nodeset or NULL (and throws an exception)
+ * if it cannot be used.
+ */
+AugNodeset *AugNodeset::unwrap(const Nan::FunctionCallbackInfo<Value> &info) {
+    AugNodeset *ns = node::ObjectWrap::Unwrap<AugNodeset>(info.This());
+    if (ns->m_obj->closed()) {
+        return NULL;
+    }
+    if (ns->m_var.empty()) {
+        Nan::ThrowError("Nodeset is freed");
+        return NULL;
+    }
+    return ns;
+}
+
+/*
+ * Reads node index from the only argument, throws an exception
+ * and returns false if the index is out of range.
+ */
+bool AugNodeset::index(const Nan::FunctionCallbackInfo<Value> &info,
+                       AugNodeset *ns, int &i) {
+    if (info.Length() != 1 || !info[0]->IsNumber()) {
+        Nan::ThrowError("Function expects node index");
+        return false;
+    }
+    i = info[0]->Int32Value(ctx()).FromMaybe(-1);
+    if (i < 0 || i >= aug_ns_count(ns->m_obj->m_aug, ns->m_var.c_str())) {
+        Nan::ThrowError("Node index is out of range");
+        return false;
+    }
+    return true;
+}
+
+Local<Value> AugNodeset::entry(int i) {
+    const char *label = NULL;
+    const char *value = NULL;
+    int index = 0;
+    if (aug_ns_label(m_obj->m_aug, m_var.c_str(), i, &label, &index) < 0 ||
+        aug_ns_value(m_obj->m_aug, m_var.c_str(), i, &value) < 0) {
+        return Nan::Null();
+    }
+
+    Local<Object> res = Nan::New<Object>();
+    res->Set(ctx(), Nan::New<String>("label").ToLocalChecked(),
+             NULL != label
+                 ? Local<Value>(Nan::New<String>(label).ToLocalChecked())
+                 : Local<Value>(Nan::Null()));
+    res->Set(ctx(), Nan::New<String>("value").ToLocalChecked(),
+             NULL != value
+                 ? Local<Value>(Nan::New<String>(value).ToLocalChecked())
+                 : Local<Value>(Nan::Null()));
+    res->Set(ctx(), Nan::New<String>("index").ToLocalChecked(),
+             Nan::New<Int32>(index));
+    return res;
+}
+
+NAN_METHOD(AugNodeset::count) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    info.GetReturnValue().Set(
+        Nan::New<Int32>(aug_ns_count(ns->m_obj->m_aug, ns->m_var.c_str())));
+}
+
+NAN_METHOD(AugNodeset::get) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    int i;
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    if (index(info, ns, i)) {
+        info.GetReturnValue().Set(ns->entry(i));
+    }
+}
+
+NAN_METHOD(AugNodeset::label) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    int i;
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    const char *label = NULL;
+    if (index(info, ns, i) &&
+        aug_ns_label(ns->m_obj->m_aug, ns->m_var.c_str(), i, &label, NULL) >= 0 &&
+        NULL != label) {
+        info.GetReturnValue().Set(Nan::New<String>(label).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(AugNodeset::value) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    int i;
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    const char *value = NULL;
+    if (index(info, ns, i) &&
+        aug_ns_value(ns->m_obj->m_aug, ns->m_var.c_str(), i, &value) >= 0) {
+        if (NULL != value) {
+            info.GetReturnValue().Set(Nan::New<String>(value).ToLocalChecked());
+        } else {
+            info.GetReturnValue().Set(Nan::Null());
+        }
+    }
+}
+
+NAN_METHOD(AugNodeset::path) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    int i;
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    char *path = NULL;
+    if (index(info, ns, i) &&
+        aug_ns_path(ns->m_obj->m_aug, ns->m_var.c_str(), i, &path) >= 0 &&
+        NULL != path) {
+        info.GetReturnValue().Set(Nan::New<String>(path).ToLocalChecked());
+    }
+    ::free(path);
+}
+
+NAN_METHOD(AugNodeset::entries) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = unwrap(info);
+    if (NULL == ns) {
+        return;
+    }
+    AugLock lock(ns->m_obj);
+    int n = aug_ns_count(ns->m_obj->m_aug, ns->m_var.c_str());
+    Local<Array> res = Nan::New<Array>(n > 0 ? n : 0);
+    for (int i = 0; i < n; ++i) {
+        res->Set(ctx(), i, ns->entry(i));
+    }
+    info.GetReturnValue().Set(res);
+}
+
+NAN_METHOD(AugNodeset::free) {
+    Nan::HandleScope scope;
+
+    AugNodeset *ns = node::ObjectWrap::Unwrap<AugNodeset>(info.This());
+    if (!ns->m_var.empty() && !ns->m_obj->m_closed) {
+        ns->m_obj->m_deadVars.push_back(ns->m_var);
+        ns->m_obj->features();
+        ns->m_obj->undefine();
+    }
+    ns->m_var.clear();
+}
+
+/*
+ * Group of nodes for aggregate().
+ */
+struct AggGroup {
+    bool null; // nodes without value (or without subpath)
+    std::string key;
+    int count;
+    std::vector<std::string> paths; // only for 'list'
+
+    AggGroup() : null(true), count(0) {}
+};
+
+/*
+ * Query of aggregate().
+ */
+struct Aggregation {
+    enum Op { COUNT, DISTINCT, LIST };
+
+    std::string expr;
+    std::string groupBy; // "value", "label" or subpath
+    Op op;
+    std::string var; // keeps the nodeset while grouping
+    std::vector<AggGroup> groups;
+};
+
+inline bool by_count(const AggGroup &a, const AggGroup &b) {
+    if (a.count != b.count) {
+        return a.count > b.count;
+    }
+    return a.null != b.null ? a.null : a.key < b.key;
+}
+
+inline bool by_key(const AggGroup &a, const AggGroup &b) {
+    return a.null != b.null ? a.null : a.key < b.key;
+}
+
+/*
+ * Helper function.
+ * Returns the number of steps of a simple relative path like
+ * "canonical" or "a/b[2]", or 0 if it has other steps (e. g. '..',
+ * '//', axes, variables, unions).
+ */
+size_t simple_steps(const std::string &path) {
+    std::vector<PathStep> steps;
+    if (path.empty() || '/' == path[0] || !split_path(path, steps)) {
+        return 0;
+    }
+    for (size_t i = 0; i < steps.size(); ++i) {
+        const PathStep &st = steps[i];
+        if ((i > 0 && "/" != st.sep) || st.base.empty() || "." == st.base ||
+            ".." == st.base || st.base.find_first_of("$:()") != std::string::npos) {
+            return 0;
+        }
+    }
+    return steps.size();
+}
+
+/*
+ * Helper function.
+ * Strips n steps from the end of a path returned by aug_ns_path(),
+ * where '/' in labels is escaped.
+ */
+std::string strip_steps(const std::string &path, size_t n) {
+    size_t end = path.length();
+    while (n > 0 && end > 0) {
+        --end;
+        if ('/' != path[end]) {
+            continue;
+        }
+        size_t bs = 0;
+        while (bs < end && '\\' == path[end - 1 - bs]) {
+            ++bs;
+        }
+        if (0 == bs % 2) {
+            --n;
+        }
+    }
+    return path.substr(0, end);
+}
+
+/*
+ * Helper function.
+ * Finds the key of each node for a subpath groupBy. Simple subpaths
+ * are evaluated for all nodes at once as '$var/groupBy', and each match
+ * is mapped to its node by path, so the cost is linear in the number
+ * of nodes. Other subpaths are evaluated by aug_get() from the root
+ * for each node, which costs the depth (and width) of the tree per node.
+ * The key is NULL (keys[i].first is false) if there is no match
+ * or more than one.
+ */
+void subpath_keys(augeas *aug, const Aggregation &agg, int n,
+                  std::vector<std::pair<bool, std::string> > &keys) {
+    const char *var = agg.var.c_str();
+    keys.assign(n, std::make_pair(false, std::string()));
+
+    size_t steps = simple_steps(agg.groupBy);
+    if (0 == steps) {
+        for (int i = 0; i < n; ++i) {
+            char *path = NULL;
+            const char *key = NULL;
+            if (aug_ns_path(aug, var, i, &path) >= 0 && NULL != path) {
+                std::string sub = std::string(path) + "/" + agg.groupBy;
+                if (1 == aug_get(aug, sub.c_str(), &key) && NULL != key) {
+                    keys[i] = std::make_pair(true, std::string(key));
+                }
+            }
+            free(path);
+        }
+        return;
+    }
+
+    std::map<std::string, int> byPath;
+    for (int i = 0; i < n; ++i) {
+        char *path = NULL;
+        if (aug_ns_path(aug, var, i, &path) >= 0 && NULL != path) {
+            byPath[path] = i;
+        }
+        free(path);
+    }
+
+    std::string subvar = agg.var + "_sub";
+    std::string subexpr = "$" + agg.var + "/" + agg.groupBy;
+    int m = aug_defvar(aug, subvar.c_str(), subexpr.c_str());
+    std::vector<int> matches(n, 0);
+    for (int j = 0; j < m; ++j) {
+        char *path = NULL;
+        const char *key = NULL;
+        if (aug_ns_path(aug, subvar.c_str(), j, &path) < 0 || NULL == path) {
+            continue;
+        }
+        std::map<std::string, int>::iterator it =
+            byPath.find(strip_steps(path, steps));
+        free(path);
+        if (it == byPath.end() || ++matches[it->second] > 1) {
+            if (it != byPath.end()) {
+                keys[it->second].first = false; // aug_get() fails too
+            }
+            continue;
+        }
+        if (aug_ns_value(aug, subvar.c_str(), j, &key) >= 0 && NULL != key) {
+            keys[it->second] = std::make_pair(true, std::string(key));
+        }
+    }
+    aug_defvar(aug, subvar.c_str(), NULL);
+}
+
+/*
+ * Helper function.
+ * Groups nodes matching agg.expr, returns -1 on error.
+ * The nodeset is kept in the variable agg.var while grouping.
+ */
+int aggregate_nodes(augeas *aug, Aggregation &agg) {
+    const char *var = agg.var.c_str();
+
+    int n = aug_defvar(aug, var, agg.expr.c_str());
+    if (n < 0) {
+        return -1;
+    }
+    n = aug_ns_count(aug, var);
+
+    std::vector<std::pair<bool, std::string> > keys;
+    if ("value" != agg.groupBy && "label" != agg.groupBy) {
+        subpath_keys(aug, agg, n, keys);
+    }
+
+    // null key first:
+    std::map<std::pair<bool, std::string>, size_t> index;
+    for (int i = 0; i < n; ++i) {
+        const char *key = NULL;
+        char *path = NULL;
+        if ("value" == agg.groupBy) {
+            aug_ns_value(aug, var, i, &key);
+        } else if ("label" == agg.groupBy) {
+            aug_ns_label(aug, var, i, &key, NULL);
+        } else if (keys[i].first) {
+            key = keys[i].second.c_str();
+        }
+
+        std::pair<bool, std::string> k(NULL != key, NULL != key ? key : "");
+        std::map<std::pair<bool, std::string>, size_t>::iterator it =
+            index.find(k);
+        if (it == index.end()) {
+            it = index.insert(std::make_pair(k, agg.groups.size())).first;
+            agg.groups.push_back(AggGroup());
+            agg.groups.back().null = !k.first;
+            agg.groups.back().key = k.second;
+        }
+        AggGroup &group = agg.groups[it->second];
+        ++group.count;
+        if (Aggregation::LIST == agg.op &&
+            aug_ns_path(aug, var, i, &path) >= 0 && NULL != path) {
+            group.paths.push_back(path);
+        }
+        free(path);
+    }
+    aug_defvar(aug, var, NULL);
+
+    std::sort(agg.groups.begin(), agg.groups.end(),
+              Aggregation::COUNT == agg.op ? by_count : by_key);
+    return 0;
+}
+
+inline Local<Value> agg_key(const AggGroup &group) {
+    if (group.null) {
+        return Nan::Null();
+    }
+    return Nan::New<String>(group.key).ToLocalChecked();
+}
+
+/*
+ * Returns the summary in the form depending on the operation.
+ */
+Local<Array> aggregation(const Aggregation &agg) {
+    Local<Array> res = Nan::New<Array>(static_cast<int>(agg.groups.size()));
+    for (size_t i = 0; i < agg.groups.size(); ++i) {
+        const AggGroup &group = agg.groups[i];
+        if (Aggregation::DISTINCT == agg.op) {
+            res->Set(ctx(), i, agg_key(group));
+            continue;
+        }
+        Local<Object> o = Nan::New<Object>();
+        o->Set(ctx(), Nan::New<String>("key").ToLocalChecked(), agg_key(group));
+        if (Aggregation::COUNT == agg.op) {
+            o->Set(ctx(), Nan::New<String>("count").ToLocalChecked(),
+                   Nan::New<Int32>(group.count));
+        } else {
+            Local<Array> paths =
+                Nan::New<Array>(static_cast<int>(group.paths.size()));
+            for (size_t j = 0; j < group.paths.size(); ++j) {
+                paths->Set(ctx(), j,
+                           Nan::New<String>(group.paths[j]).ToLocalChecked());
+            }
+            o->Set(ctx(), Nan::New<String>("paths").ToLocalChecked(), paths);
+        }
+        res->Set(ctx(), i, o);
+    }
+    return res;
+}
+
+struct AggregateUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    Aggregation agg;
+    int rc;
+    AsyncTimes times;
+};
+
+void LibAugeas::aggregateWork(uv_work_t *req) {
+    AggregateUV *auv = static_cast<AggregateUV *>(req->data);
+    AugLock lock(auv->obj, true);
+    auv->times.started = uv_hrtime();
+    auv->rc = aggregate_nodes(auv->aug, auv->agg);
+    auv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::aggregateAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    AggregateUV *auv = static_cast<AggregateUV *>(req->data);
+    auv->obj->inflight(-1);
+    trace("aggregate", auv->obj->id(), auv->agg.expr, -1, auv->times.queued,
+          auv->times.started, auv->times.finished);
+    Local<Value> argv[] = { Nan::New<Int32>(auv->rc), Nan::Undefined() };
+    if (0 == auv->rc) {
+        argv[1] = aggregation(auv->agg);
+    }
+
+    Nan::TryCatch try_catch;
+    auv->callback.Call(2, argv);
+    auv->handle.Reset();
+    delete auv;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Groups nodes matching path expression and returns only the summary:
+ *
+ * aug.aggregate('/files/etc/ssh/sshd_config/PermitRootLogin',
+ *               { groupBy: 'value', op: 'count' })
+ *
+ * groupBy - 'value' (default), 'label' or a path relative to each node,
+ *           e. g. 'canonical' for entries of /etc/hosts; a path of plain
+ *           steps is evaluated for all nodes at once, other paths
+ *           (with '..', '//', axes etc.) once per node from the root,
+ *           which is much slower on large trees,
+ * op - one of:
+ *      'count' (default) - [{ key: 'no', count: 4990 }, ...],
+ *                          the largest groups first,
+ *      'distinct' - ['no', 'yes', ...],
+ *      'list' - [{ key: 'no', paths: [...] }, ...].
+ *
+ * Key is null for nodes without value (or without the subpath).
+ * Groups are sorted by key, except for 'count'.
+ *
+ * Without callback works synchronously and throws an exception on error.
+ * With callback (the last argument) works on the threadpool and executes
+ * the callback with two arguments: 0 and the result on success,
+ * -1 on error (see errorMsg()). The nodeset is kept in the variable
+ * 'aggregate<N>' while grouping.
+ */
+NAN_METHOD(LibAugeas::aggregate) {
+    Nan::HandleScope scope;
+
+    int last = info.Length() - 1;
+    bool async = info.Length() > 1 && info[last]->IsFunction();
+    if (info.Length() < 1 || info.Length() > (async ? 3 : 2) ||
+        (info.Length() == (async ? 3 : 2) && !info[1]->IsObject())) {
+        Nan::ThrowError("Function expects path expression, optional options "
+                        "and optional callback");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value e_str(isol(), info[0]);
+
+    static unsigned int lastVar = 0;
+    Aggregation agg;
+    agg.expr = *e_str;
+    agg.groupBy = "value";
+    agg.op = Aggregation::COUNT;
+    agg.var = "aggregate" + std::to_string(++lastVar);
+    if (info.Length() > 1 && info[1]->IsObject() && !info[1]->IsFunction()) {
+        Local<Object> opts = info[1]->ToObject(ctx()).ToLocalChecked();
+        std::string groupBy = memberToString(opts, "groupBy");
+        std::string op = memberToString(opts, "op");
+        if (!groupBy.empty()) {
+            agg.groupBy = groupBy;
+        }
+        if ("distinct" == op) {
+            agg.op = Aggregation::DISTINCT;
+        } else if ("list" == op) {
+            agg.op = Aggregation::LIST;
+        } else if (!op.empty() && "count" != op) {
+            Nan::ThrowError("Unknown aggregate operation");
+            return;
+        }
+    }
+
+    AugLock lock(obj);
+    obj->touch(agg.expr);
+
+    if (async) {
+        AggregateUV *auv = new AggregateUV();
+        auv->request.data = auv;
+        auv->obj = obj;
+        auv->aug = obj->m_aug;
+        auv->agg = agg;
+        auv->handle.Reset(info.This());
+        auv->callback.SetFunction(Local<Function>::Cast(info[last]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &auv->request, aggregateWork,
+                      (uv_after_work_cb)aggregateAfter);
+        return;
+    }
+
+    OpSpan span("aggregate", obj->m_id, agg.expr.c_str());
+    if (aggregate_nodes(obj->m_aug, agg) < 0) {
+        throw_aug_error_msg(obj->m_aug);
+        return;
+    }
+    info.GetReturnValue().Set(aggregation(agg));
+}
+
+/*
+ * Wrapper of aug_print().
+ * Returns an object of key/value matching given path expression
+ */
+NAN_METHOD(LibAugeas::print) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function expects incl argument");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    String::Utf8Value incl(isol(), info[0]);
+    Local<Object> res = Nan::New<Object>();
+
+    std::string matchPath = "/files" + std::string(*incl) + "/*";
+    OpSpan span("print", obj->m_id, matchPath.c_str());
+    AugLock lock(obj);
+    obj->touch(matchPath);
+    FILE *out = tmpfile();
+    if (aug_print(obj->m_aug, out, matchPath.c_str()) == 0) {
+        char line[256];
+        rewind(out);
+        while (fgets(line, 256, out) != NULL) {
+            // remove end of line
+            line[strlen(line) - 1] = '\0';
+            std::string s = line;
+            ;
+            // skip comments
+            if (s.find("#comment") != std::string::npos)
+                continue;
+            s = s.substr(matchPath.length() - 1);
+            // split by '=' sign
+            size_t eqpos = s.find(" = ");
+            if (eqpos == std::string::npos)
+                continue;
+            // extract key and value
+            std::string key = s.substr(0, eqpos);
+            std::string value = s.substr(eqpos + 3);
+            // remove '"' sign from around value
+            value.erase(value.begin());
+            value.erase(value.end() - 1);
+            res->Set(ctx(),
+                     Nan::New<String>(key).ToLocalChecked(),
+                     Nan::New<String>(value).ToLocalChecked());
+        }
+
+        fclose(out);
+        info.GetReturnValue().Set(res);
+    }
+
+    fclose(out);
+    Nan::Undefined();
+}
+
+struct TextUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    AugOp op;
+    int rc;
+    AsyncTimes times;
+
+    TextUV(const AugOp &o) : op(o) {}
+};
+
+void LibAugeas::parseTextWork(uv_work_t *req) {
+    TextUV *tuv = static_cast<TextUV *>(req->data);
+    AugLock lock(tuv->obj, true);
+    tuv->times.started = uv_hrtime();
+    tuv->rc = apply_op(tuv->aug, tuv->op);
+    tuv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::parseTextAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    TextUV *tuv = static_cast<TextUV *>(req->data);
+    tuv->obj->inflight(-1);
+    if (tuv->rc >= 0) {
+        tuv->obj->record(tuv->op);
+        if (grows_tree(tuv->op)) {
+            tuv->obj->updateMemory();
+        }
+    }
+    trace("parseText", tuv->obj->id(), tuv->op.c, -1, tuv->times.queued,
+          tuv->times.started, tuv->times.finished);
+    Local<Value> argv[] = { Nan::New<Int32>(tuv->rc < 0 ? -1 : 0) };
+
+    Nan::TryCatch try_catch;
+    tuv->callback.Call(1, argv);
+    tuv->handle.Reset();
+    delete tuv;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Wrapper of aug_text_store() - parse text in memory.
+ *
+ * Arguments:
+ * lens - e. g. "hosts", "Hosts.lns" or "@Hosts"
+ * text - string or Buffer
+ * path - where to store the tree, e. g. "/parsed/hosts"
+ * callback - optional
+ *
+ * The tree at path is replaced. No files are read.
+ * Without callback the text is parsed synchronously and an exception
+ * is thrown on error. With callback the text is parsed on the threadpool
+ * and the callback is executed with one integer argument: 0 on success,
+ * -1 on error (see loadErrors() for details).
+ */
+NAN_METHOD(LibAugeas::parseText) {
+    Nan::HandleScope scope;
+
+    if (info.Length() < 3 || info.Length() > 4 ||
+        (info.Length() == 4 && !info[3]->IsFunction())) {
+        Nan::ThrowError("Function expects lens, text, path and "
+                        "optional callback");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+    String::Utf8Value l_str(isol(), info[0]);
+    String::Utf8Value p_str(isol(), info[2]);
+
+    std::string text;
+    if (node::Buffer::HasInstance(info[1])) {
+        text.assign(node::Buffer::Data(info[1]), node::Buffer::Length(info[1]));
+    } else {
+        String::Utf8Value t_str(isol(), info[1]);
+        text = *t_str;
+    }
+
+    AugOp op(AugOp::TEXT_STORE, *l_str, text, *p_str);
+    AugLock lock(obj);
+    obj->touchOp(op);
+
+    if (info.Length() == 4) {
+        TextUV *tuv = new TextUV(op);
+        tuv->request.data = tuv;
+        tuv->obj = obj;
+        tuv->aug = obj->m_aug;
+        tuv->handle.Reset(info.This());
+        tuv->callback.SetFunction(Local<Function>::Cast(info[3]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &tuv->request, parseTextWork,
+                      (uv_after_work_cb)parseTextAfter);
+        return;
+    }
+
+    OpSpan span("parseText", obj->m_id, op.c.c_str());
+    std::string error;
+    if (text_store(obj->m_aug, op.a, op.b, op.c, &error) < 0) {
+        Nan::ThrowError(error.c_str());
+    } else {
+        obj->record(op);
+        if (grows_tree(op)) {
+            obj->updateMemory();
+        }
+    }
+}
+
+struct RenderUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    std::string lens;
+    std::vector<std::string> paths;
+    std::vector<char *> out;
+    bool batch; // paths were given as an array
+    int rc;
+    AsyncTimes times;
+};
+
+/*
+ * Helper function.
+ * Wraps text allocated by render() into a Buffer without copying.
+ */
+inline Local<Value> text_buffer(char *text) {
+    if (NULL == text) {
+        return Nan::Null();
+    }
+    return Nan::NewBuffer(text, strlen(text)).ToLocalChecked();
+}
+
+/*
+ * Helper function.
+ * Returns Buffer or array of Buffers (if batch) and frees the texts.
+ */
+Local<Value> text_buffers(std::vector<char *> &out, bool batch) {
+    if (!batch) {
+        return text_buffer(out[0]);
+    }
+    Local<Array> res = Nan::New<Array>(static_cast<int>(out.size()));
+    for (size_t i = 0; i < out.size(); ++i) {
+        res->Set(ctx(), i, text_buffer(out[i]));
+    }
+    return res;
+}
+
+void LibAugeas::renderWork(uv_work_t *req) {
+    RenderUV *ruv = static_cast<RenderUV *>(req->data);
+    AugLock lock(ruv->obj, true);
+    ruv->times.started = uv_hrtime();
+    ruv->rc = 0;
+    for (size_t i = 0; i < ruv->paths.size() && 0 == ruv->rc; ++i) {
+        ruv->rc = render(ruv->aug, ruv->lens, ruv->paths[i], &ruv->out[i],
+                         NULL);
+        if (ruv->rc < 0 && ruv->obj->m_readonly) {
+            clean_text_error(ruv->aug, ruv->paths[i]);
+        }
+    }
+    ruv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::renderAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    RenderUV *ruv = static_cast<RenderUV *>(req->data);
+    ruv->obj->inflight(-1);
+    trace(ruv->lens.empty() ? "preview" : "renderText", ruv->obj->id(),
+          ruv->batch ? "" : ruv->paths[0], static_cast<int>(ruv->paths.size()),
+          ruv->times.queued, ruv->times.started, ruv->times.finished);
+    Local<Value> argv[] = { Nan::New<Int32>(ruv->rc), Nan::Undefined() };
+    if (0 == ruv->rc) {
+        argv[1] = text_buffers(ruv->out, ruv->batch);
+    } else {
+        for (size_t i = 0; i < ruv->out.size(); ++i) {
+            free(ruv->out[i]);
+        }
+    }
+
+    Nan::TryCatch try_catch;
+    ruv->callback.Call(2, argv);
+    ruv->handle.Reset();
+    delete ruv;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+/*
+ * Common part of renderText() and preview().
+ * info[pathArg] is a path or an array of paths,
+ * optionally followed by a callback.
+ */
+void LibAugeas::renderPaths(const Nan::FunctionCallbackInfo<Value> &info,
+                            const std::string &lens, int pathArg) {
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+
+    bool async = info.Length() == pathArg + 2;
+    if (info.Length() < pathArg + 1 || info.Length() > pathArg + 2 ||
+        (async && !info[pathArg + 1]->IsFunction())) {
+        Nan::ThrowError("Wrong arguments");
+        return;
+    }
+
+    std::vector<std::string> paths;
+    bool batch = info[pathArg]->IsArray();
+    if (batch) {
+        Local<Array> a = Local<Array>::Cast(info[pathArg]);
+        for (uint32_t i = 0; i < a->Length(); ++i) {
+            String::Utf8Value p_str(isol(), a->Get(ctx(), i).ToLocalChecked());
+            paths.push_back(*p_str);
+        }
+    } else {
+        String::Utf8Value p_str(isol(), info[pathArg]);
+        paths.push_back(*p_str);
+    }
+    AugLock lock(obj);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        obj->touch(paths[i]);
+    }
+
+    if (async) {
+        RenderUV *ruv = new RenderUV();
+        ruv->request.data = ruv;
+        ruv->obj = obj;
+        ruv->aug = obj->m_aug;
+        ruv->lens = lens;
+        ruv->paths.swap(paths);
+        ruv->out.resize(ruv->paths.size(), NULL);
+        ruv->batch = batch;
+        ruv->handle.Reset(info.This());
+        ruv->callback.SetFunction(Local<Function>::Cast(info[pathArg + 1]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &ruv->request, renderWork,
+                      (uv_after_work_cb)renderAfter);
+        return;
+    }
+
+    OpSpan span(lens.empty() ? "preview" : "renderText", obj->m_id,
+                batch ? NULL : paths[0].c_str());
+    span.files(static_cast<int>(paths.size()));
+    std::vector<char *> out(paths.size(), NULL);
+    std::string error;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (render(obj->m_aug, lens, paths[i], &out[i], &error) < 0) {
+            if (obj->m_readonly) {
+                clean_text_error(obj->m_aug, paths[i]);
+            }
+            for (size_t j = 0; j < i; ++j) {
+                free(out[j]);
+            }
+            Nan::ThrowError(error.c_str());
+            return;
+        }
+    }
+    info.GetReturnValue().Set(text_buffers(out, batch));
+}
+
+/*
+ * Wrapper of aug_text_retrieve() - render a tree into text in memory.
+ *
+ * Arguments:
+ * lens - e. g. "hosts", "Hosts.lns" or "@Hosts"
+ * path - tree to render (e. g. "/parsed/hosts"), or an array of paths
+ * callback - optional
+ *
+ * Returns a Buffer (or an array of Buffers) with the text.
+ * The tree is rendered with the default formatting of the lens.
+ * Without callback works synchronously and throws an exception on error.
+ * With callback works on the threadpool and executes the callback
+ * with two arguments: 0 and the result on success, -1 on error.
+ */
+NAN_METHOD(LibAugeas::renderText) {
+    Nan::HandleScope scope;
+
+    if (info.Length() < 2) {
+        Nan::ThrowError("Function expects lens, path and optional callback");
+        return;
+    }
+    String::Utf8Value l_str(isol(), info[0]);
+    renderPaths(info, *l_str, 1);
+}
+
+/*
+ * Wrapper of aug_preview() - returns the content of a file as aug_save()
+ * would write it, without writing anything.
+ *
+ * Arguments:
+ * path - file node (e. g. "/files/etc/hosts"), or an array of file nodes
+ * callback - optional
+ *
+ * Returns a Buffer (or an array of Buffers, null for paths
+ * without a file). Without callback works synchronously
+ * and throws an exception on error. With callback works on the threadpool
+ * and executes the callback with two arguments: 0 and the result
+ * on success, -1 on error.
+ */
+NAN_METHOD(LibAugeas::preview) {
+    Nan::HandleScope scope;
+
+    renderPaths(info, std::string(), 0);
+}
+
+/*
+ * Wrapper of aug_load() - load /files
+ * In lazy mode files are only enumerated, see createAugeas().
+ */
+NAN_METHOD(LibAugeas::load) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        Nan::Undefined();
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+
     /*
-     * Return 1 if there is exactly one node matching PATH,
-     * 0 if there is none, and a negative value
-     * if there is more than one node matching PATH,
-     * or if PATH is not a legal path expression.
-     *
-     * The string *value must not be freed by the caller,
-     * and is valid as long as its node remains unchanged.
+     * aug_load() returns -1 on error, 0 on success. Success includes the case
+     * where some files could not be loaded. Details of such files can be found
+     * as '/augeas//error'.
      */
-    int rc = aug_get(obj->m_aug, path, &value);
-    if (1 == rc) {
-        if (NULL != value) {
-            info.GetReturnValue().Set(Nan::New<String>(value).ToLocalChecked());
-        } else {
-            Nan::Null();
-        }
-    } else if (0 == rc) {
+    OpSpan span("load", obj->m_id);
+    AugLock lock(obj);
+    int rc = obj->m_lazy ? lazy_load(obj->m_aug, obj->m_lazyFiles)
+                         : aug_load(obj->m_aug);
+    if (AUG_NOERROR != rc) {
+        Nan::ThrowError("Failed to load files");
+    } else {
+        obj->record(AugOp(AugOp::LOAD));
+        obj->updateMemory();
+    }
+    if (span.active()) {
+        span.files(loaded_files(obj->m_aug));
+    }
+
+    Nan::Undefined();
+}
+
+/*
+ * Wrapper of aug_srun() - run augeas commands (like augtool does)
+ * Returns the number of executed commands.
+ * Throws expression on error or if the 'quit' command encountered.
+ * Arguments:
+ * string or array of strings
+ */
+NAN_METHOD(LibAugeas::srun) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1) {
+        Nan::ThrowError("Function accepts exactly one argument");
         Nan::Undefined();
-    } else if (rc < 0) {
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
+
+    std::string text;
+
+    if (info[0]->IsArray()) {
+        text = join(Local<Array>::Cast(info[0]));
+    } else {
+        String::Utf8Value t_str(isol(), info[0]);
+        text = *t_str;
+    }
+
+    /*
+     * Returns the number of executed commands on success,
+     * -1 on failure, and -2 if a 'quit' command was encountered.
+     * TODO: use output (the second argument to aug_srun() != NULL)
+     */
+    OpSpan span("srun", obj->m_id);
+    AugLock lock(obj);
+    obj->touch("/files");
+    int rc = aug_srun(obj->m_aug, NULL, text.c_str());
+    // commands before a failed one are executed, so record it anyway:
+    AugOp op(AugOp::SRUN, text, "", "", rc < 0 ? AugOp::FAILED : 0);
+    obj->record(op);
+    if (grows_tree(op)) {
+        obj->updateMemory();
+    }
+    if (rc >= 0) {
+        info.GetReturnValue().Set(Nan::New<Number>(rc));
+    } else if (-1 == rc) {
         throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
+    } else if (-2 == rc) {
+        Nan::ThrowError("'quit' command was encountered");
     } else {
-        Nan::ThrowError("Unexpected return value of aug_get()");
-        Nan::Undefined();
+        Nan::ThrowError("Unexpected return code from aug_srun()");
+    }
+
+    Nan::Undefined();
+}
+
+/*
+ * Maximum number and approximate size of cached results,
+ * the least recently used are forgotten when exceeded.
+ */
+static const size_t CACHE_SIZE = 10000;
+static const int64_t CACHE_BYTES = 16 * 1024 * 1024;
+
+/*
+ * Helper function.
+ * Approximate memory of cached result: strings, map and list nodes.
+ */
+size_t cache_bytes(const std::string &key, const CacheEntry &entry) {
+    static const size_t OVERHEAD = 32; // per string or node
+    size_t bytes = 2 * key.length() + entry.scope.length() +
+                   entry.value.length() + 6 * OVERHEAD;
+    for (size_t i = 0; i < entry.paths.size(); ++i) {
+        bytes += entry.paths[i].length() + OVERHEAD;
+    }
+    return bytes;
+}
+
+/*
+ * Returns cached result or NULL, counts hits and misses.
+ */
+CacheEntry *LibAugeas::cached(char kind, const char *expr) {
+    std::map<std::string, CacheEntry>::iterator it =
+        m_cache.find(kind + std::string(expr));
+    if (it == m_cache.end()) {
+        ++m_misses;
+        return NULL;
+    }
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    return &it->second;
+}
+
+void LibAugeas::cacheStore(char kind, const char *expr, CacheEntry &entry) {
+    std::string key = kind + std::string(expr);
+    std::map<std::string, CacheEntry>::iterator it = m_cache.find(key);
+    if (it != m_cache.end()) {
+        cacheErase(it);
+    }
+
+    entry.scope = path_scope(expr);
+    entry.bytes = cache_bytes(key, entry);
+    if (static_cast<int64_t>(entry.bytes) > CACHE_BYTES) {
+        return;
+    }
+    while (!m_lru.empty() &&
+           (m_cache.size() >= CACHE_SIZE ||
+            m_cacheBytes + static_cast<int64_t>(entry.bytes) > CACHE_BYTES)) {
+        cacheErase(m_cache.find(m_lru.back()));
+    }
+
+    m_lru.push_front(key);
+    entry.lru = m_lru.begin();
+    m_cacheBytes += entry.bytes;
+    adjustMemory(entry.bytes);
+    std::swap(m_cache[key], entry);
+}
+
+void LibAugeas::cacheErase(std::map<std::string, CacheEntry>::iterator it) {
+    m_cacheBytes -= it->second.bytes;
+    adjustMemory(-static_cast<int64_t>(it->second.bytes));
+    m_lru.erase(it->second.lru);
+    m_cache.erase(it);
+}
+
+void LibAugeas::cacheClear() {
+    adjustMemory(-m_cacheBytes);
+    m_cacheBytes = 0;
+    m_cache.clear();
+    m_lru.clear();
+}
+
+/*
+ * Forgets cached results which may refer to nodes in the subtree.
+ */
+void LibAugeas::invalidate(const std::string &scope) {
+    std::map<std::string, CacheEntry>::iterator it = m_cache.begin();
+    while (it != m_cache.end()) {
+        if (scopes_overlap(it->second.scope, scope)) {
+            cacheErase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/*
+ * Forgets cached results which may be changed by the operation.
+ */
+void LibAugeas::invalidate(const AugOp &op) {
+    std::string scope;
+    switch (op.kind) {
+    case AugOp::SET:
+    case AugOp::SETM:
+    case AugOp::RM:
+        invalidate(path_scope(op.a));
+        break;
+    case AugOp::MV:
+        invalidate(path_scope(op.a));
+        invalidate(path_scope(op.b));
+        break;
+    case AugOp::INSERT:
+        // a sibling is added, so the parent changes:
+        scope = path_scope(op.a);
+        invalidate(scope.substr(0, scope.rfind('/')));
+        break;
+    case AugOp::TEXT_STORE:
+        invalidate(path_scope(op.c));
+        invalidate("/augeas");
+        break;
+    default: // DEFVAR, DEFNODE, SRUN, LOAD, LOAD_FILE
+        cacheClear();
+        break;
+    }
+}
+
+/*
+ * Enables (cache(true)) or disables (cache(false)) caching of results
+ * of get(), match() and nmatch() by expression. Cached results are
+ * forgotten when the tree under the literal part of the expression
+ * (e. g. /files/etc/hosts for /files/etc/hosts//ipaddr[. = '::1'])
+ * is modified by set, setm, rm, mv, insert*, parseText. Expressions with
+ * variables, axes or absolute paths in predicates are forgotten on any
+ * modification. All results are forgotten on load, srun, defvar, defnode
+ * (and on loading files in lazy mode). Results under /augeas are also
+ * forgotten on save. At most 10000 results and 16 MB are kept, the least
+ * recently used results are forgotten first. Memory of cached results
+ * is reported to V8 as the tree is.
+ * Note that changes of files made by other processes are not detected
+ * until files are loaded again.
+ */
+NAN_METHOD(LibAugeas::cache) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1 || !info[0]->IsBoolean()) {
+        Nan::ThrowError("Function expects true or false");
+        return;
+    }
+
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
     }
+    obj->m_caching = info[0]->IsTrue();
+    obj->features();
+    obj->cacheClear();
 }
 
 /*
- * Wrapper of aug_set() - set exactly one value
- * Note: this method (as aug_set) does not write any files,
- *       it just changes internal tree. To write files use LibAugeas::save()
+ * Returns { hits: 10, misses: 2, size: 2 } - counters of cache lookups
+ * since the handle was created and the number of cached results.
  */
-NAN_METHOD(LibAugeas::set) {
+NAN_METHOD(LibAugeas::cacheStats) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 2) {
-        Nan::ThrowError("Function accepts exactly two arguments");
-        Nan::Undefined();
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
     }
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-    String::Utf8Value v_str(isol(), info[1]);
+    Local<Object> res = Nan::New<Object>();
+    res->Set(ctx(), Nan::New<String>("hits").ToLocalChecked(),
+             Nan::New<Number>(obj->m_hits));
+    res->Set(ctx(), Nan::New<String>("misses").ToLocalChecked(),
+             Nan::New<Number>(obj->m_misses));
+    res->Set(ctx(), Nan::New<String>("size").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(obj->m_cache.size())));
+    info.GetReturnValue().Set(res);
+}
 
-    const char *path = *p_str;
-    const char *value = *v_str;
+/*
+ * Throws an exception if close() was called. Otherwise makes sure
+ * that writes queued by writeBatch() are applied before the call,
+ * see syncWrites().
+ */
+bool LibAugeas::closed() {
+    if (m_closed) {
+        Nan::ThrowError("Augeas handle is closed");
+        return true;
+    }
+    if (!m_failed.empty()) {
+        Nan::ThrowError(("Augeas replica is out of sync: " + m_failed).c_str());
+        return true;
+    }
+    if (NULL != m_running) {
+        syncWrites();
+    }
+    if (!m_deadVars.empty()) {
+        undefine();
+    }
+    return false;
+}
 
-    /*
-     * 0 on success, -1 on error. It is an error
-     * if more than one node matches path.
-     */
-    int rc = aug_set(obj->m_aug, path, value);
-    if (AUG_NOERROR != rc) {
-        throw_aug_error_msg(obj->m_aug);
+/*
+ * Undefines variables of garbage collected nodesets. The finalizer
+ * only queues them: it may run at any time, e. g. while m_aug is used
+ * on the threadpool or in the middle of a call. This is called
+ * on the main thread at the start of calls (see closed()),
+ * when no async operation uses m_aug.
+ */
+void LibAugeas::undefine() {
+    if (m_closed || m_inflight > 0) {
+        return;
     }
-    Nan::Undefined();
+    for (size_t i = 0; i < m_deadVars.size(); ++i) {
+        aug_defvar(m_aug, m_deadVars[i].c_str(), NULL);
+        m_nodesets.erase(m_deadVars[i]);
+    }
+    if (NULL != m_back) {
+        m_deadBack.insert(m_deadBack.end(), m_deadVars.begin(),
+                          m_deadVars.end());
+    }
+    m_deadVars.clear();
+    features();
 }
 
 /*
- * Wrapper of aug_setm() - set the value of multiple nodes in one operation
- * Returns the number of modified nodes on success.
+ * Approximate native memory per tree node: struct tree,
+ * label, value and malloc overhead.
  */
-NAN_METHOD(LibAugeas::setm) {
-    Nan::HandleScope scope;
+static const int64_t NODE_BYTES = 160;
 
-    if (info.Length() != 3) {
-        Nan::ThrowError("Function accepts exactly three arguments");
-        Nan::Undefined();
+/*
+ * Reports the size of the tree to V8, so that garbage collection
+ * takes native memory into account. Counting nodes walks the whole
+ * tree, so this is called only when the tree may grow a lot
+ * (see grows_tree()): after creating, loading, and srun, parseText
+ * or replay loading files or on large input. Small changes are not
+ * counted until then.
+ */
+void LibAugeas::updateMemory() {
+    if (NULL == m_aug || m_closed) {
+        return;
     }
+    int nodes = aug_match(m_aug, "//*", NULL);
+    if (nodes >= 0) {
+        // a replica has two copies of the tree:
+        int64_t copies = m_readonly ? 2 : 1;
+        adjustMemory(copies * nodes * NODE_BYTES + m_cacheBytes - m_memory);
+    }
+}
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value b_str(isol(), info[0]);
-    String::Utf8Value s_str(isol(), info[1]);
-    String::Utf8Value v_str(isol(), info[2]);
-
-    const char *base = *b_str;
-    const char *sub = *s_str;
-    const char *value = *v_str;
+void LibAugeas::adjustMemory(int64_t bytes) {
+    m_memory += bytes;
+    // V8 takes int, larger trees are reported in steps:
+    while (0 != bytes) {
+        int64_t step = std::max<int64_t>(-INT_MAX,
+                                         std::min<int64_t>(INT_MAX, bytes));
+        Nan::AdjustExternalMemory(static_cast<int>(step));
+        bytes -= step;
+    }
+}
 
-    int rc = aug_setm(obj->m_aug, base, sub, value);
-    if (rc >= 0) {
-        info.GetReturnValue().Set(Nan::New<Int32>(rc));
-    } else {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
+/*
+ * Counts async operations using m_aug. When a replica's handle
+ * is not used any more, it can be switched, see replayPending().
+ */
+void LibAugeas::inflight(int n) {
+    m_inflight += n;
+    features();
+    if (0 == m_inflight && m_readonly) {
+        replayPending(this);
     }
 }
 
 /*
- * Wrapper of aug_rm() - remove nodes
- * Remove path and all its children. Returns the number of entries removed.
- * All nodes that match PATH, and their descendants, are removed.
+ * Updates m_plain, see plain().
  */
-NAN_METHOD(LibAugeas::rm) {
-    Nan::HandleScope scope;
+void LibAugeas::features() {
+    m_plain = !m_closed && !m_readonly && m_failed.empty() && !m_lazy &&
+              !m_caching && !m_journaling && m_replicas.empty() &&
+              0 == m_inflight && m_deadVars.empty();
+}
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function accepts exactly one argument");
-        Nan::Undefined();
+/*
+ * Throws an exception if this is a read-only replica.
+ * Otherwise the tree is about to change: pending copies
+ * for replicas are taken first, see copyLater().
+ */
+bool LibAugeas::readonly() {
+    if (m_readonly) {
+        Nan::ThrowError("Augeas replica is read-only");
+        return true;
+    }
+    if (!m_copies.empty()) {
+        takeCopies(true);
     }
+    return false;
+}
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
+/*
+ * Copy of the tree for replicas, see copyLater().
+ */
+struct TreeCopyUV {
+    uv_work_t request;
+    LibAugeas *obj;
+    bool taken;               // under the lock of obj
+    bool finished;            // copyAfter() was called
+    bool sent;                // to the replicas
+    std::vector<AugOp> ops;   // the copy, see copy_tree()
+    std::vector<AugOp> after; // operations recorded after the copy
+    AsyncTimes times;
+
+    TreeCopyUV() : obj(NULL), taken(false), finished(false), sent(false) {}
+};
 
-    const char *path = *p_str;
+/*
+ * Remembers what future replicas need to know about successful operation
+ * (see snapshot()) and passes it to existing replicas.
+ */
+void LibAugeas::record(const AugOp &op, bool journal) {
+    if (m_caching) {
+        invalidate(op);
+    }
+    if (m_readonly) {
+        return;
+    }
 
-    int rc = aug_rm(obj->m_aug, path);
-    if (rc >= 0) {
-        info.GetReturnValue().Set(Nan::New<Number>(rc));
+    switch (op.kind) {
+    case AugOp::LOAD:
+        m_loaded = true;
+        m_modified = false;
+        break;
+    case AugOp::DEFVAR:
+        if (op.flags & AugOp::NULL_VALUE) {
+            m_vars.erase(op.a);
+        } else {
+            m_vars.erase(op.a);
+            m_vars.insert(std::make_pair(op.a, op));
+        }
+        break;
+    case AugOp::DEFNODE:
+        m_vars.erase(op.a);
+        m_vars.insert(std::make_pair(op.a, op));
+        m_modified = true;
+        break;
+    default:
+        m_modified = true;
+        break;
+    }
+    if (m_journaling && journal && AugOp::LOAD != op.kind) {
+        m_journal.push_back(op);
+    }
+
+    if (m_replicas.empty()) {
+        return;
+    }
+    if (AugOp::SRUN == op.kind && srun_touches_files(op.a)) {
+        // loading or saving again may give another tree,
+        // so replicas get a copy of the resulting one:
+        copyLater();
+    } else if (!m_copies.empty()) {
+        m_copies.back()->after.push_back(op);
     } else {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
+        forward(std::vector<AugOp>(1, op));
     }
 }
 
 /*
- * Wrapper of aug_mv() - move nodes
+ * Passes operations to the replicas to replay.
  */
-NAN_METHOD(LibAugeas::mv) {
-    Nan::HandleScope scope;
+void LibAugeas::forward(const std::vector<AugOp> &ops) {
+    for (size_t i = 0; i < m_replicas.size(); ++i) {
+        LibAugeas *replica = m_replicas[i];
+        replica->m_ops.insert(replica->m_ops.end(), ops.begin(), ops.end());
+        replayPending(replica);
+    }
+}
 
-    if (info.Length() != 2) {
-        Nan::ThrowError("Function accepts exactly two arguments");
-        Nan::Undefined();
+/*
+ * Called after aug_save() succeeded: the tree matches files,
+ * unless files are not written in 'newfile' or 'noop' mode.
+ */
+void LibAugeas::saved() {
+    const char *mode = NULL;
+    if (1 == aug_get(m_aug, "/augeas/save", &mode) && NULL != mode &&
+        0 != strcmp(mode, "overwrite") && 0 != strcmp(mode, "backup")) {
+        return;
     }
+    m_modified = false;
+}
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value src(isol(), info[0]);
-    String::Utf8Value dst(isol(), info[1]);
+/*
+ * Enables lazy mode with files enumerated by lazy_load().
+ */
+void LibAugeas::lazy(LazyFiles &files) {
+    m_lazy = true;
+    features();
+    std::swap(m_lazyFiles, files);
+}
 
-    const char *source = *src;
-    const char *dest = *dst;
+/*
+ * In lazy mode loads files required to evaluate path expression.
+ * Loading is recorded for replicas, but not in the journal.
+ */
+void LibAugeas::lazyTouch(const std::string &path) {
+    std::vector<std::string> files = lazy_files(m_lazyFiles, path);
+    for (size_t i = 0; i < files.size(); ++i) {
+        AugOp incl(AugOp::SET, m_lazyFiles.pending[files[i]] + "/incl[last()+1]",
+                   files[i]);
+        AugOp load(AugOp::LOAD_FILE, files[i]);
+        m_lazyFiles.pending.erase(files[i]);
+
+        OpSpan span("loadFile", m_id, files[i].c_str());
+        apply_op(m_aug, incl);
+        apply_op(m_aug, load);
+        record(incl, false);
+        record(load, false);
+    }
+    if (!files.empty()) {
+        updateMemory();
+    }
+}
 
-    /*
-     * 0 on success, -1 on error. It is an error
-     * if more than one node matches path.
-     */
-    int rc = aug_mv(obj->m_aug, source, dest);
-    if (AUG_NOERROR != rc) {
-        throw_aug_error_msg(obj->m_aug);
+/*
+ * Loads files required by the operation in lazy mode.
+ */
+void LibAugeas::touchOp(const AugOp &op) {
+    switch (op.kind) {
+    case AugOp::SET:
+    case AugOp::SETM:
+    case AugOp::RM:
+    case AugOp::INSERT:
+        touch(op.a);
+        break;
+    case AugOp::TEXT_STORE:
+        touch(op.c);
+        break;
+    case AugOp::MV:
+        touch(op.a);
+        touch(op.b);
+        break;
+    case AugOp::DEFVAR:
+    case AugOp::DEFNODE:
+        if (!(op.flags & AugOp::NULL_VALUE) || AugOp::DEFNODE == op.kind) {
+            touch(op.b);
+        }
+        break;
+    case AugOp::SRUN:
+        // commands are not parsed, load everything:
+        touch("/files");
+        break;
+    default:
+        break;
     }
-    Nan::Undefined();
+}
+
+// The tree but /augeas, see copy_tree():
+static const char COPY_TOP[] = "/*[label() != 'augeas']";
+
+/*
+ * Helper function.
+ * Appends operations replacing the subtree top (the tree but /augeas
+ * by default) of another handle with a copy of this one, node by node.
+ * The cost is linear in the number of nodes here, but setting a node
+ * by path on the other handle costs the depth and width of the tree.
+ * Called on the threadpool too, see copyLater().
+ */
+void copy_tree(augeas *aug, std::vector<AugOp> &ops,
+               const char *top = COPY_TOP) {
+    static std::atomic<unsigned int> lastVar(0);
+    std::string var = "snapshot" + std::to_string(++lastVar);
+
+    ops.push_back(AugOp(AugOp::RM, top));
+    // parents come before children, siblings in order:
+    int n = aug_defvar(aug, var.c_str(),
+                       (std::string(top) + "/descendant-or-self::*").c_str());
+    for (int i = 0; i < n; ++i) {
+        char *path = NULL;
+        const char *val = NULL;
+        if (aug_ns_path(aug, var.c_str(), i, &path) < 0 || NULL == path ||
+            aug_ns_value(aug, var.c_str(), i, &val) < 0) {
+            free(path);
+            continue;
+        }
+        if (NULL != val) {
+            ops.push_back(AugOp(AugOp::SET, path, val));
+        } else {
+            ops.push_back(AugOp(AugOp::SET, path, "", "", AugOp::NULL_VALUE));
+        }
+        free(path);
+    }
+    aug_defvar(aug, var.c_str(), NULL);
 }
 
 /*
- * Wrapper of aug_insert(aug, path, label, 0) - insert 'label' after 'path'
+ * Returns operations which bring a fresh augeas handle
+ * (created with AUG_NO_LOAD) to the state of this one:
+ * copy /augeas/load and /augeas/context, load files if they were loaded,
+ * copy the tree if it may differ from files and define variables. Variables are evaluated on the copy,
+ * so nodes added after a variable was defined are in its nodeset.
  */
-NAN_METHOD(LibAugeas::insertAfter) {
+std::vector<AugOp> LibAugeas::snapshot() {
+    std::vector<AugOp> ops;
+    const char *val;
+
+    ops.push_back(AugOp(AugOp::RM, "/augeas/load"));
+
+    char **xfms = NULL;
+    int nxfms = aug_match(m_aug, "/augeas/load/*", &xfms);
+    for (int i = 0; i < nxfms; ++i) {
+        ops.push_back(AugOp(AugOp::SET, xfms[i], "", "", AugOp::NULL_VALUE));
+
+        char **opts = NULL;
+        int nopts = aug_match(m_aug, (std::string(xfms[i]) + "/*").c_str(),
+                              &opts);
+        for (int j = 0; j < nopts; ++j) {
+            // there may be many 'incl' or 'excl' nodes:
+            std::string path = std::string(xfms[i]) + "/" +
+                               path_label(opts[j]) + "[last()+1]";
+            if (1 == aug_get(m_aug, opts[j], &val) && NULL != val) {
+                ops.push_back(AugOp(AugOp::SET, path, val));
+            } else {
+                ops.push_back(
+                    AugOp(AugOp::SET, path, "", "", AugOp::NULL_VALUE));
+            }
+        }
+        free_matches(opts, nopts);
+    }
+    free_matches(xfms, nxfms);
+
+    if (1 == aug_get(m_aug, "/augeas/context", &val) && NULL != val) {
+        ops.push_back(AugOp(AugOp::SET, "/augeas/context", val));
+    }
+
+    if (m_loaded) {
+        ops.push_back(AugOp(AugOp::LOAD));
+    }
+    if (m_modified) {
+        copy_tree(m_aug, ops);
+    }
+    for (std::map<std::string, AugOp>::const_iterator it = m_vars.begin();
+         it != m_vars.end(); ++it) {
+        ops.push_back(it->second);
+    }
+
+    return ops;
+}
+
+/*
+ * After srun which loaded or saved files replicas get a copy of the tree
+ * instead of the commands (see record()), which costs the size
+ * of the tree. So the copy is taken on the threadpool, holding the lock
+ * (async operations count it, so sync calls lock too). Operations
+ * recorded meanwhile wait in the copy until it is passed to replicas.
+ * If the tree is about to change before that (see readonly()),
+ * the copy is taken on the main thread first.
+ */
+void LibAugeas::copyLater() {
+    TreeCopyUV *cuv = new TreeCopyUV();
+    cuv->request.data = cuv;
+    cuv->obj = this;
+    m_copies.push_back(cuv);
+
+    ++m_copying;
+    inflight(1);
+    Ref();
+    uv_queue_work(uv_default_loop(), &cuv->request, copyWork,
+                  (uv_after_work_cb)copyAfter);
+}
+
+void LibAugeas::copyWork(uv_work_t *req) {
+    TreeCopyUV *cuv = static_cast<TreeCopyUV *>(req->data);
+    AugLock lock(cuv->obj, true);
+    cuv->times.started = uv_hrtime();
+    if (!cuv->taken) {
+        copy_tree(cuv->obj->m_aug, cuv->ops);
+        cuv->taken = true;
+    }
+    cuv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::copyAfter(uv_work_t *req) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 2) {
-        Nan::ThrowError("Function accepts exactly two arguments");
-        Nan::Undefined();
+    TreeCopyUV *cuv = static_cast<TreeCopyUV *>(req->data);
+    LibAugeas *obj = cuv->obj;
+    obj->inflight(-1);
+    --obj->m_copying;
+    trace("replicaCopy", obj->id(), "", -1, cuv->times.queued,
+          cuv->times.started, cuv->times.finished);
+    cuv->finished = true;
+    if (cuv->sent) {
+        delete cuv;
+    } else {
+        obj->sendCopies(false);
     }
+    obj->Unref();
+}
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-    String::Utf8Value l_str(isol(), info[1]);
+/*
+ * Takes pending copies on the main thread (unless copy is false,
+ * e. g. on close) and passes them to replicas. Only the last one
+ * is taken: it replaces the tree after operations of the others.
+ */
+void LibAugeas::takeCopies(bool copy) {
+    uv_mutex_lock(&m_lock);
+    for (size_t i = 0; i < m_copies.size(); ++i) {
+        TreeCopyUV *cuv = m_copies[i];
+        if (!cuv->taken && copy && i + 1 == m_copies.size()) {
+            copy_tree(m_aug, cuv->ops);
+        }
+        cuv->taken = true;
+    }
+    uv_mutex_unlock(&m_lock);
+    sendCopies(true);
+}
 
-    const char *path = *p_str;
-    const char *label = *l_str;
+/*
+ * Passes taken copies and operations recorded after them to replicas
+ * in order: all of them, or the ones taken on the threadpool.
+ */
+void LibAugeas::sendCopies(bool all) {
+    while (!m_copies.empty() && (all || m_copies.front()->finished)) {
+        TreeCopyUV *cuv = m_copies.front();
+        m_copies.pop_front();
+        forward(cuv->ops);
+        forward(cuv->after);
+        if (cuv->finished) {
+            delete cuv;
+        } else {
+            cuv->sent = true;
+        }
+    }
+}
 
-    int rc = aug_insert(obj->m_aug, path, label, 0);
-    if (AUG_NOERROR != rc) {
-        throw_aug_error_msg(obj->m_aug);
+struct ReplicaUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    LibAugeas *replica;
+    std::vector<AugOp> ops;
+    bool create;
+    augeas *aug;  // created replica handles
+    augeas *back;
+    std::string error; // see replay_ops()
+    AsyncTimes times;
+};
+
+/*
+ * Helper function.
+ * Applies operations recorded by the primary to a replica handle.
+ * Returns false and the error if an operation fails, unless
+ * it failed on the primary too: the replica is out of sync.
+ */
+bool replay_ops(augeas *aug, const std::vector<AugOp> &ops,
+                std::string &error) {
+    for (size_t i = 0; i < ops.size(); ++i) {
+        bool failed = apply_op(aug, ops[i]) < 0;
+        if (failed != ((ops[i].flags & AugOp::FAILED) != 0)) {
+            error = failed ? aug_error_msg(aug)
+                           : "srun failed on the primary, but not here";
+            return false;
+        }
     }
-    Nan::Undefined();
+    return true;
 }
 
 /*
- * Wrapper of aug_insert(aug, path, label, 1) - insert 'label' before 'path'
+ * Helper function.
+ * Creates a replica handle and applies the snapshot.
  */
-NAN_METHOD(LibAugeas::insertBefore) {
+augeas *open_replica(const std::string &root, const std::string &loadpath,
+                     unsigned int flags, const std::vector<AugOp> &ops,
+                     std::string &error) {
+    augeas *aug = aug_init(root.c_str(), loadpath.c_str(),
+                           flags | AUG_NO_LOAD | AUG_NO_ERR_CLOSE);
+    if (NULL == aug) {
+        error = "aug_init() failed";
+    } else if (AUG_NOERROR != aug_error(aug)) {
+        error = aug_error_msg(aug);
+    } else {
+        replay_ops(aug, ops, error);
+    }
+    return aug;
+}
+
+/*
+ * Helper function.
+ * Returns the snapshot for the second replica handle: it copies the tree
+ * of the first one (aug) instead of loading files again.
+ */
+std::vector<AugOp> clone_ops(augeas *aug, const std::vector<AugOp> &ops) {
+    std::vector<AugOp> clone;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (AugOp::LOAD != ops[i].kind) {
+            clone.push_back(ops[i]);
+            continue;
+        }
+        copy_tree(aug, clone, "/augeas/files");
+        // a modified tree is copied after loading anyway:
+        if (i + 1 == ops.size() || AugOp::RM != ops[i + 1].kind ||
+            COPY_TOP != ops[i + 1].a) {
+            copy_tree(aug, clone);
+        }
+    }
+    return clone;
+}
+
+/*
+ * Creates the replica handles (if needed) or replays operations
+ * on the second one. If that fails, the replica is out of sync
+ * (see replicaAfter()).
+ */
+void LibAugeas::replicaWork(uv_work_t *req) {
+    ReplicaUV *ruv = static_cast<ReplicaUV *>(req->data);
+    LibAugeas *replica = ruv->replica;
+
+    ruv->times.started = uv_hrtime();
+    if (ruv->create) {
+        ruv->aug = open_replica(replica->m_root, replica->m_loadpath,
+                                replica->m_flags, ruv->ops, ruv->error);
+        if (ruv->error.empty()) {
+            ruv->back = open_replica(replica->m_root, replica->m_loadpath,
+                                     replica->m_flags,
+                                     clone_ops(ruv->aug, ruv->ops),
+                                     ruv->error);
+        }
+    } else {
+        replay_ops(replica->m_back, ruv->ops, ruv->error);
+    }
+    ruv->times.finished = uv_hrtime();
+}
+
+void LibAugeas::replicaAfter(uv_work_t *req) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 2) {
-        Nan::ThrowError("Function accepts exactly two arguments");
-        Nan::Undefined();
+    ReplicaUV *ruv = static_cast<ReplicaUV *>(req->data);
+    LibAugeas *replica = ruv->replica;
+
+    if (ruv->create) {
+        replica->m_aug = ruv->aug;
+        replica->m_back = ruv->back;
     }
+    trace(ruv->create ? "replica" : "replicaSync", replica->id(), "",
+          -1, ruv->times.queued, ruv->times.started, ruv->times.finished);
+    replica->m_busy = false;
+    if (!ruv->error.empty()) {
+        // every call throws, and the primary does not pass operations:
+        replica->m_failed = ruv->error;
+        replica->features();
+        replica->detach();
+        replica->m_ops.clear();
+        replica->m_frontAt = 0;
+        replica->m_backAt = 0;
+    }
+    if (replica->m_closed) {
+        aug_close(replica->m_back);
+        replica->m_back = NULL;
+        if (ruv->create) {
+            aug_close(replica->m_aug);
+            replica->m_aug = NULL;
+        }
+    } else if (ruv->create) {
+        replica->updateMemory();
+    }
+    // switch handles, operations recorded by primary while we were busy:
+    replayPending(replica);
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-    String::Utf8Value l_str(isol(), info[1]);
+    if (ruv->create && !ruv->callback.IsEmpty()) {
+        Local<Value> argv[] = { replica->handle() };
 
-    const char *path = *p_str;
-    const char *label = *l_str;
+        Nan::TryCatch try_catch;
+        ruv->callback.Call(1, argv);
+        if (try_catch.HasCaught()) {
+            Nan::FatalException(try_catch);
+        }
+    }
+    replica->Unref();
+    delete ruv;
+}
+
+/*
+ * A replica has two handles with the same tree: reads use m_aug
+ * on the main thread, while operations of the primary are replayed
+ * on m_back on the threadpool, so reads never wait for replaying.
+ * When m_back is ahead and m_aug is not used by an async operation
+ * (e. g. aggregate()), the handles are switched, and the operations
+ * are replayed on the other handle too.
+ *
+ * This function switches handles if possible and starts replaying
+ * pending operations, unless the replica is busy. In the latter case
+ * it is called again when the replica is done.
+ */
+void LibAugeas::replayPending(LibAugeas *replica) {
+    if (replica->m_busy || replica->m_closed || !replica->m_failed.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < replica->m_deadBack.size(); ++i) {
+        aug_defvar(replica->m_back, replica->m_deadBack[i].c_str(), NULL);
+    }
+    replica->m_deadBack.clear();
+
+    if (replica->m_backAt > replica->m_frontAt && 0 == replica->m_inflight) {
+        std::vector<AugOp> ops(replica->m_ops.begin() + replica->m_frontAt,
+                               replica->m_ops.begin() + replica->m_backAt);
+        std::swap(replica->m_aug, replica->m_back);
+        std::swap(replica->m_frontAt, replica->m_backAt);
+        for (std::map<std::string, std::string>::const_iterator it =
+                 replica->m_nodesets.begin();
+             it != replica->m_nodesets.end(); ++it) {
+            aug_defvar(replica->m_aug, it->first.c_str(), it->second.c_str());
+        }
+        // operations applied to both handles:
+        replica->m_ops.erase(replica->m_ops.begin(),
+                             replica->m_ops.begin() + replica->m_backAt);
+        replica->m_frontAt -= replica->m_backAt;
+        replica->m_backAt = 0;
+
+        if (replica->m_caching) {
+            for (size_t i = 0; i < ops.size(); ++i) {
+                replica->invalidate(ops[i]);
+            }
+        }
+        if (grows_tree(ops)) {
+            replica->updateMemory();
+        }
+    }
 
-    int rc = aug_insert(obj->m_aug, path, label, 1);
-    if (AUG_NOERROR != rc) {
-        throw_aug_error_msg(obj->m_aug);
+    if (replica->m_backAt == replica->m_ops.size()) {
+        return;
     }
-    Nan::Undefined();
+
+    ReplicaUV *ruv = new ReplicaUV();
+    ruv->request.data = ruv;
+    ruv->replica = replica;
+    ruv->create = false;
+    ruv->aug = NULL;
+    ruv->back = NULL;
+    ruv->ops.assign(replica->m_ops.begin() + replica->m_backAt,
+                    replica->m_ops.end());
+    replica->m_backAt = replica->m_ops.size();
+
+    replica->m_busy = true;
+    replica->Ref();
+    uv_queue_work(uv_default_loop(), &ruv->request, replicaWork,
+                  (uv_after_work_cb)replicaAfter);
 }
 
 /*
- * Wrapper of aug_error()
- * Returns the error code from the last API call
+ * Creates a read-only replica of this augeas handle.
+ *
+ * The replica is a separate augeas handle, which loads the same files
+ * (and copies the tree node by node if it was modified since files were
+ * loaded or saved) and then is kept in sync with this (primary) handle
+ * by replaying all its modifications (set, setm, rm, mv, insert*, defnode,
+ * defvar, load, srun) on the threadpool. After srun loading or saving
+ * files the replica gets a copy of the resulting tree instead
+ * (see copyLater()). Thus reading from the replica does not interfere with
+ * the primary, e. g. while it is saving files asynchronously. The replica
+ * lags behind the primary until pending operations are replayed.
+ * If creating the replica or replaying fails (unless the operation failed
+ * on the primary too), the replica is out of sync: any call on it throws
+ * an exception, and the sync form throws at once.
+ *
+ * The replica keeps two copies of the tree: one is read while the other
+ * one is replaying operations (see replayPending()), so reading never
+ * waits for replaying, at the cost of twice the memory. Files are loaded
+ * once, the second copy is cloned from the first one.
+ *
+ * Only reading functions are allowed on the replica, any function
+ * modifying the tree or files throws an exception. Handles created
+ * with the lazy option cannot be replicated: they load files
+ * on first access, which the replica would not know about.
+ *
+ * As createAugeas() this function works either in sync or async way
+ * depending on the argument:
+ *
+ * aug.replica(function(replica) {...}) - async
+ *
+ * or:
+ *
+ * var replica = aug.replica() - sync
  */
-NAN_METHOD(LibAugeas::error) {
+NAN_METHOD(LibAugeas::replica) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 0) {
-        Nan::ThrowError("Function does not accept arguments");
-        Nan::Undefined();
+    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed()) {
+        return;
+    }
+    if (obj->m_readonly) {
+        Nan::ThrowError("Cannot create replica of replica");
+        return;
+    }
+    if (obj->m_lazy) {
+        Nan::ThrowError("Cannot create replica of lazy handle");
+        return;
     }
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    bool async = (info.Length() == 1) && info[0]->IsFunction();
+    if (info.Length() != 0 && !async) {
+        Nan::ThrowError("Callback function or nothing");
+        return;
+    }
 
-    int rc = aug_error(obj->m_aug);
-    info.GetReturnValue().Set(Nan::New<Int32>(rc));
+    // existing replicas get pending copies, the new one the snapshot:
+    if (!obj->m_copies.empty()) {
+        obj->takeCopies(true);
+    }
+    Local<Object> handle =
+        New(NULL, obj->m_root, obj->m_loadpath, obj->m_flags, obj->m_loaded);
+    LibAugeas *replica = node::ObjectWrap::Unwrap<LibAugeas>(handle);
+    replica->m_primary = obj;
+    replica->m_readonly = true;
+    replica->m_busy = true;
+    replica->features();
+    obj->m_replicas.push_back(replica);
+    obj->features();
+
+    ReplicaUV *ruv = new ReplicaUV();
+    ruv->request.data = ruv;
+    ruv->replica = replica;
+    ruv->create = true;
+    ruv->aug = NULL;
+    ruv->back = NULL;
+    {
+        AugLock lock(obj);
+        ruv->ops = obj->snapshot();
+    }
+    replica->Ref();
+
+    if (async) {
+        ruv->callback.SetFunction(Local<Function>::Cast(info[0]));
+        uv_queue_work(uv_default_loop(), &ruv->request, replicaWork,
+                      (uv_after_work_cb)replicaAfter);
+    } else {
+        replicaWork(&ruv->request);
+        replicaAfter(&ruv->request);
+        if (!replica->m_failed.empty()) {
+            Nan::ThrowError(
+                ("Cannot create replica: " + replica->m_failed).c_str());
+            return;
+        }
+        info.GetReturnValue().Set(handle);
+    }
 }
 
 /*
- * Returns the error message from the last API call,
- * including all details.
+ * Starts recording modifications of the tree (set, setm, rm, mv,
+ * insertAfter, insertBefore, defvar, defnode, srun) into a journal.
+ * The previous journal, if any, is discarded.
+ * The journal can be replayed on another handle with replay().
  */
-NAN_METHOD(LibAugeas::errorMsg) {
+NAN_METHOD(LibAugeas::journalStart) {
     Nan::HandleScope scope;
 
     if (info.Length() != 0) {
         Nan::ThrowError("Function does not accept arguments");
-        Nan::Undefined();
+        return;
     }
 
     LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    if (obj->closed() || obj->readonly()) {
+        return;
+    }
 
-    info.GetReturnValue().Set(
-        Nan::New<String>(aug_error_msg(obj->m_aug)).ToLocalChecked());
+    obj->m_journal.clear();
+    obj->m_journaling = true;
+    obj->features();
 }
 
 /*
- * Returns the lens load error message
+ * Stops recording and returns the journal as a Buffer.
  */
-NAN_METHOD(LibAugeas::errorLens) {
+NAN_METHOD(LibAugeas::journalStop) {
     Nan::HandleScope scope;
-    const char *val;
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function expects lens argument");
-        Nan::Undefined();
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        return;
     }
-    String::Utf8Value lens(isol(), info[0]);
 
     LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-
-    std::string errPath = "/augeas/load/" + std::string(*lens) + "/error";
-    if (aug_get(obj->m_aug, errPath.c_str(), &val)) {
-        info.GetReturnValue().Set(Nan::New<String>(val).ToLocalChecked());
+    if (obj->closed()) {
+        return;
     }
 
-    Nan::Undefined();
+    std::string data = serialize_ops(obj->m_journal);
+    obj->m_journal.clear();
+    obj->m_journaling = false;
+    obj->features();
+
+    info.GetReturnValue().Set(
+        Nan::CopyBuffer(data.data(), data.length()).ToLocalChecked());
 }
 
 /*
- * Returns the incl parsed error message
+ * Returns the journal recorded so far as a Buffer
+ * without stopping recording.
  */
-NAN_METHOD(LibAugeas::errorIncl) {
+NAN_METHOD(LibAugeas::journal) {
     Nan::HandleScope scope;
-    int mres;
-    const char *val;
-    char **matches;
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function expects incl argument");
-        Nan::Undefined();
+    if (info.Length() != 0) {
+        Nan::ThrowError("Function does not accept arguments");
+        return;
     }
-    String::Utf8Value incl(isol(), info[0]);
 
     LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-
-    std::string errPath = "/augeas/files" + std::string(*incl) + "/error";
-    mres = aug_match(obj->m_aug, errPath.c_str(), &matches);
-    if (mres) {
-        Local<Object> res = Nan::New<Object>();
-
-        if (aug_get(obj->m_aug, std::string(errPath + "/line").c_str(), &val)) {
-            res->Set(ctx(), Nan::New<String>("line").ToLocalChecked(),
-                     Nan::New<String>(val).ToLocalChecked());
-        }
-        if (aug_get(obj->m_aug, std::string(errPath + "/message").c_str(),
-                    &val)) {
-            res->Set(ctx(), Nan::New<String>("message").ToLocalChecked(),
-                     Nan::New<String>(val).ToLocalChecked());
-        }
-        free(matches);
-        info.GetReturnValue().Set(res);
+    if (obj->closed()) {
+        return;
     }
 
-    Nan::Undefined();
+    std::string data = serialize_ops(obj->m_journal);
+    info.GetReturnValue().Set(
+        Nan::CopyBuffer(data.data(), data.length()).ToLocalChecked());
 }
 
-struct SaveUV {
+struct ReplayUV {
     uv_work_t request;
     Nan::Callback callback;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
     augeas *aug;
-    int rc; // = aug_save(), 0 on success, -1 on error
+    std::vector<AugOp> ops;
+    size_t applied; // number of successfully applied operations
+    AsyncTimes times;
 };
 
-void saveWork(uv_work_t *req) {
-    SaveUV *suv = static_cast<SaveUV *>(req->data);
-    suv->rc = aug_save(suv->aug);
+void LibAugeas::replayWork(uv_work_t *req) {
+    ReplayUV *ruv = static_cast<ReplayUV *>(req->data);
+    AugLock lock(ruv->obj, true);
+    ruv->times.started = uv_hrtime();
+    for (ruv->applied = 0; ruv->applied < ruv->ops.size(); ++ruv->applied) {
+        if (apply_op(ruv->aug, ruv->ops[ruv->applied]) < 0) {
+            break;
+        }
+    }
+    ruv->times.finished = uv_hrtime();
 }
 
-/*
- * Execute JS callback after saveWork() terminated
- */
-void saveAfter(uv_work_t *req) {
+void LibAugeas::replayAfter(uv_work_t *req) {
     Nan::HandleScope scope;
 
-    SaveUV *suv = static_cast<SaveUV *>(req->data);
-    Local<Value> argv[] = { Nan::New<Int32>(suv->rc) };
+    ReplayUV *ruv = static_cast<ReplayUV *>(req->data);
+    ruv->obj->inflight(-1);
+    for (size_t i = 0; i < ruv->applied; ++i) {
+        ruv->obj->record(ruv->ops[i]);
+    }
+    if (grows_tree(ruv->ops)) {
+        ruv->obj->updateMemory();
+    }
+    trace("replay", ruv->obj->id(), "", -1, ruv->times.queued,
+          ruv->times.started, ruv->times.finished);
+
+    int rc = (ruv->applied == ruv->ops.size()) ? static_cast<int>(ruv->applied)
+                                                : -1;
+    Local<Value> argv[] = { Nan::New<Int32>(rc) };
 
     Nan::TryCatch try_catch;
-    suv->callback.Call(1, argv);
-    delete suv;
+    ruv->callback.Call(1, argv);
+    ruv->handle.Reset();
+    delete ruv;
     if (try_catch.HasCaught()) {
         Nan::FatalException(try_catch);
     }
 }
 
 /*
- * Wrapper of aug_save() - save changed files.
- *
- * Without arguments this function performs blocking saving
- * and throws an exception on error.
- *
- * The only argument allowed is a callback function.
- * If such an argument is given this function performs
- * non-blocking (async) saving, and after saving is done (or failed)
- * executes the callback with one integer argument - return value of aug_save(),
- * i. e. 0 on success, -1 on failure.
+ * Applies the journal (a Buffer returned by journalStop() or journal(),
+ * possibly from another handle) to this handle in one call.
+ * Operations are applied in order, replaying stops at the first failed one.
  *
- * NOTE: multiple async calls of this function (from the same augeas object)
- * will result in crash (double free or segfault) because of using
- * shared augeas handle.
+ * Without callback this function works synchronously,
+ * returns the number of applied operations and throws an exception on error.
  *
- * Always returns undefined.
- */
-NAN_METHOD(LibAugeas::save) {
-    Nan::HandleScope scope;
-
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-
-    // if no info, save files synchronously (blocking):
-    if (info.Length() == 0) {
-        int rc = aug_save(obj->m_aug);
-        if (AUG_NOERROR != rc) {
-            Nan::ThrowError("Failed to write files");
-        }
-        // single argument is a function - async:
-    } else if ((info.Length() == 1) && info[0]->IsFunction()) {
-        SaveUV *suv = new SaveUV();
-        suv->request.data = suv;
-        suv->aug = obj->m_aug;
-        suv->callback.SetFunction(Local<Function>::Cast(info[0]));
-        uv_queue_work(uv_default_loop(), &suv->request, saveWork,
-                      (uv_after_work_cb)saveAfter);
-    } else {
-        Nan::ThrowError("Callback function or nothing");
-    }
-
-    Nan::Undefined();
-}
-
-/*
- * Wrapper of aug_match(aug, path, NULL) - count all nodes matching path
- * expression
- * Returns the number of found nodes.
- * Note: aug_match() allocates memory if the third argument is not NULL,
- * in this function we always set it to NULL and get only number of found nodes.
+ * If the second argument is a function, operations are applied
+ * on the threadpool and the callback is executed with one integer argument:
+ * the number of applied operations on success, -1 on failure
+ * (use errorMsg() for details).
  */
-NAN_METHOD(LibAugeas::nmatch) {
+NAN_METHOD(LibAugeas::replay) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function accepts exactly one argument");
-        Nan::Undefined();
+    if (info.Length() < 1 || info.Length() > 2 ||
+        !node::Buffer::HasInstance(info[0]) ||
+        (info.Length() == 2 && !info[1]->IsFunction())) {
+        Nan::ThrowError("Function expects journal buffer and "
+                        "optional callback");
+        return;
     }
 
     LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-
-    const char *path = *p_str;
-
-    int rc = aug_match(obj->m_aug, path, NULL);
-    if (rc >= 0) {
-        info.GetReturnValue().Set(Nan::New<Number>(rc));
-    } else {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
+    if (obj->closed() || obj->readonly()) {
+        return;
     }
-}
-
-/*
- * Wrapper of aug_match(, , non-NULL).
- * Returns an array of nodes matching given path expression
- */
-NAN_METHOD(LibAugeas::match) {
-    Nan::HandleScope scope;
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function accepts exactly one argument");
-        Nan::Undefined();
+    std::vector<AugOp> ops;
+    if (!parse_ops(node::Buffer::Data(info[0]), node::Buffer::Length(info[0]),
+                   ops)) {
+        Nan::ThrowError("Invalid journal");
+        return;
     }
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value p_str(isol(), info[0]);
-
-    const char *path = *p_str;
-    char **matches = NULL;
+    AugLock lock(obj);
+    if (info.Length() == 2) {
+        for (size_t i = 0; i < ops.size(); ++i) {
+            obj->touchOp(ops[i]);
+        }
+        ReplayUV *ruv = new ReplayUV();
+        ruv->request.data = ruv;
+        ruv->obj = obj;
+        ruv->aug = obj->m_aug;
+        ruv->ops.swap(ops);
+        ruv->applied = 0;
+        ruv->handle.Reset(info.This());
+        ruv->callback.SetFunction(Local<Function>::Cast(info[1]));
+        obj->inflight(1);
+        uv_queue_work(uv_default_loop(), &ruv->request, replayWork,
+                      (uv_after_work_cb)replayAfter);
+        return;
+    }
 
-    int rc = aug_match(obj->m_aug, path, &matches);
-    if (rc >= 0) {
-        Local<Array> result = Nan::New<Array>(rc);
-        if (NULL != matches) {
-            for (int i = 0; i < rc; ++i) {
-                result->Set(ctx(), Nan::New<Number>(i),
-                            Nan::New<String>(matches[i]).ToLocalChecked());
-                free(matches[i]);
+    OpSpan span("replay", obj->m_id);
+    for (size_t i = 0; i < ops.size(); ++i) {
+        obj->touchOp(ops[i]);
+        if (apply_op(obj->m_aug, ops[i]) < 0) {
+            std::string msg = "Failed to replay operation #" +
+                              std::to_string(i) + ": " +
+                              aug_error_msg(obj->m_aug);
+            if (grows_tree(ops)) {
+                obj->updateMemory();
             }
-            free(matches);
+            Nan::ThrowError(msg.c_str());
+            return;
         }
-        info.GetReturnValue().Set(result);
-    } else {
-        throw_aug_error_msg(obj->m_aug);
-        Nan::Undefined();
+        obj->record(ops[i]);
+    }
+    if (grows_tree(ops)) {
+        obj->updateMemory();
     }
+
+    info.GetReturnValue().Set(Nan::New<Number>(ops.size()));
 }
 
 /*
- * Wrapper of aug_print().
- * Returns an object of key/value matching given path expression
+ * writeBatch() call: its callback and its operations in WriteBatchUV::ops.
  */
-NAN_METHOD(LibAugeas::print) {
-    Nan::HandleScope scope;
-
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function expects incl argument");
-        Nan::Undefined();
-    }
-
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
-    String::Utf8Value incl(isol(), info[0]);
-    Local<Object> res = Nan::New<Object>();
+struct WriteCall {
+    Nan::Callback *callback;
+    size_t begin;
+    size_t end;
+};
 
-    std::string matchPath = "/files" + std::string(*incl) + "/*";
-    FILE *out = tmpfile();
-    if (aug_print(obj->m_aug, out, matchPath.c_str()) == 0) {
-        char line[256];
-        rewind(out);
-        while (fgets(line, 256, out) != NULL) {
-            // remove end of line
-            line[strlen(line) - 1] = '\0';
-            std::string s = line;
-            ;
-            // skip comments
-            if (s.find("#comment") != std::string::npos)
-                continue;
-            s = s.substr(matchPath.length() - 1);
-            // split by '=' sign
-            size_t eqpos = s.find(" = ");
-            if (eqpos == std::string::npos)
-                continue;
-            // extract key and value
-            std::string key = s.substr(0, eqpos);
-            std::string value = s.substr(eqpos + 3);
-            // remove '"' sign from around value
-            value.erase(value.begin());
-            value.erase(value.end() - 1);
-            res->Set(ctx(),
-                     Nan::New<String>(key).ToLocalChecked(),
-                     Nan::New<String>(value).ToLocalChecked());
-        }
+struct WriteBatchUV {
+    uv_work_t request;
+    Nan::Persistent<Object> handle; // keeps obj alive
+    LibAugeas *obj;
+    augeas *aug;
+    std::vector<WriteCall> calls;
+    std::vector<AugOp> ops;
+    std::vector<int> rcs;
+    std::vector<std::string> errors;
+    size_t applied;  // the number of ops applied, see syncWrites()
+    size_t recorded; // and passed to LibAugeas::record()
+    AsyncTimes times;
+};
 
-        fclose(out);
-        info.GetReturnValue().Set(res);
+/*
+ * Helper function.
+ * Applies operations of the batch not applied yet. Unlike replay,
+ * operations are independent: a failed one does not stop the others.
+ * The caller holds the lock of the handle.
+ */
+void apply_batch(WriteBatchUV *wuv) {
+    wuv->rcs.resize(wuv->ops.size(), 0);
+    wuv->errors.resize(wuv->ops.size());
+    for (; wuv->applied < wuv->ops.size(); ++wuv->applied) {
+        size_t i = wuv->applied;
+        wuv->rcs[i] = apply_op(wuv->aug, wuv->ops[i]);
+        if (wuv->rcs[i] < 0) {
+            wuv->errors[i] = aug_error_msg(wuv->aug);
+        }
     }
+}
 
-    fclose(out);
-    Nan::Undefined();
+void LibAugeas::writeBatchWork(uv_work_t *req) {
+    WriteBatchUV *wuv = static_cast<WriteBatchUV *>(req->data);
+    AugLock lock(wuv->obj, true);
+    wuv->times.started = uv_hrtime();
+    apply_batch(wuv);
+    wuv->times.finished = uv_hrtime();
 }
 
 /*
- * Wrapper of aug_load() - load /files
+ * Records successful operations of the batch applied so far.
  */
-NAN_METHOD(LibAugeas::load) {
+void LibAugeas::recordWrites(WriteBatchUV *wuv) {
+    for (; wuv->recorded < wuv->applied; ++wuv->recorded) {
+        if (wuv->rcs[wuv->recorded] >= 0) {
+            record(wuv->ops[wuv->recorded]);
+        }
+    }
+}
+
+/*
+ * Called on the main thread before any other call uses the tree while
+ * batches are pending: waits for the running batch under the lock
+ * (or applies it, if it has not started yet) and applies the waiting
+ * one, so that the call sees all writes queued before it, and records
+ * them before the call records its own operation. The jobs on the
+ * threadpool then have nothing left to apply, but still pass results
+ * to callbacks asynchronously.
+ */
+void LibAugeas::syncWrites() {
+    uv_mutex_lock(&m_lock);
+    apply_batch(m_running);
+    if (NULL != m_batch) {
+        apply_batch(m_batch);
+    }
+    uv_mutex_unlock(&m_lock);
+
+    recordWrites(m_running);
+    if (NULL != m_batch) {
+        recordWrites(m_batch);
+    }
+}
+
+void LibAugeas::writeBatchAfter(uv_work_t *req) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 0) {
-        Nan::ThrowError("Function does not accept arguments");
-        Nan::Undefined();
+    WriteBatchUV *wuv = static_cast<WriteBatchUV *>(req->data);
+    LibAugeas *obj = wuv->obj;
+    obj->inflight(-1);
+    obj->m_running = NULL;
+    trace("writeBatch", obj->id(), "", -1, wuv->times.queued,
+          wuv->times.started, wuv->times.finished);
+    obj->recordWrites(wuv);
+    // calls made meanwhile, before callbacks can make more:
+    if (NULL != obj->m_batch) {
+        obj->startWrites();
     }
 
-    LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    for (size_t c = 0; c < wuv->calls.size(); ++c) {
+        const WriteCall &call = wuv->calls[c];
+        Local<Array> results =
+            Nan::New<Array>(static_cast<int>(call.end - call.begin));
+        for (size_t i = call.begin; i < call.end; ++i) {
+            Local<Object> res = Nan::New<Object>();
+            res->Set(ctx(), Nan::New<String>("rc").ToLocalChecked(),
+                     Nan::New<Int32>(wuv->rcs[i] < 0 ? -1 : wuv->rcs[i]));
+            if (wuv->rcs[i] < 0) {
+                res->Set(ctx(), Nan::New<String>("error").ToLocalChecked(),
+                         Nan::New<String>(wuv->errors[i]).ToLocalChecked());
+            }
+            results->Set(ctx(), i - call.begin, res);
+        }
+        Local<Value> argv[] = { results };
 
-    /*
-     * aug_load() returns -1 on error, 0 on success. Success includes the case
-     * where some files could not be loaded. Details of such files can be found
-     * as '/augeas//error'.
-     */
-    int rc = aug_load(obj->m_aug);
-    if (AUG_NOERROR != rc) {
-        Nan::ThrowError("Failed to load files");
+        Nan::TryCatch try_catch;
+        call.callback->Call(1, argv);
+        delete call.callback;
+        if (try_catch.HasCaught()) {
+            Nan::FatalException(try_catch);
+        }
     }
+    wuv->handle.Reset();
+    delete wuv;
+}
 
-    Nan::Undefined();
+/*
+ * Queues the waiting batch on the threadpool.
+ */
+void LibAugeas::startWrites() {
+    WriteBatchUV *wuv = m_batch;
+    m_batch = NULL;
+    m_running = wuv;
+    wuv->times = AsyncTimes();
+    inflight(1);
+    uv_queue_work(uv_default_loop(), &wuv->request, writeBatchWork,
+                  (uv_after_work_cb)writeBatchAfter);
 }
 
 /*
- * Wrapper of aug_srun() - run augeas commands (like augtool does)
- * Returns the number of executed commands.
- * Throws expression on error or if the 'quit' command encountered.
- * Arguments:
- * string or array of strings
+ * Applies many independent modifications in one job on the threadpool:
+ *
+ * aug.writeBatch([['set', path, value],
+ *                 ['rm', path],
+ *                 ['mv', source, destination]], function(results) {...})
+ *
+ * Value of 'set' may be null. Operations are applied in order,
+ * each one whether the previous ones failed or not.
+ * The callback gets an array of results in the order of operations:
+ * { rc: 0 } on success (for 'rm' rc is the number of removed nodes),
+ * { rc: -1, error: '...' } on failure.
+ *
+ * Batches of a handle are applied one at a time in the order of calls:
+ * calls made while a batch is running are applied together in the next
+ * job. Any other function called while batches are pending waits for
+ * them (and applies them itself, if they have not started yet), so that
+ * it cannot read the tree before earlier writes or modify it in between.
+ * Callbacks are called asynchronously anyway.
+ * See also setAsync(), rmAsync() and mvAsync() in index.js.
  */
-NAN_METHOD(LibAugeas::srun) {
+NAN_METHOD(LibAugeas::writeBatch) {
     Nan::HandleScope scope;
 
-    if (info.Length() != 1) {
-        Nan::ThrowError("Function accepts exactly one argument");
-        Nan::Undefined();
+    if (info.Length() != 2 || !info[0]->IsArray() || !info[1]->IsFunction()) {
+        Nan::ThrowError("Function expects array of operations and callback");
+        return;
     }
 
     LibAugeas *obj = node::ObjectWrap::Unwrap<LibAugeas>(info.This());
+    // not closed(): it would wait for the running batch
+    if (obj->m_closed) {
+        Nan::ThrowError("Augeas handle is closed");
+        return;
+    }
+    if (obj->readonly()) {
+        return;
+    }
 
-    std::string text;
+    std::vector<AugOp> ops;
+    Local<Array> a = Local<Array>::Cast(info[0]);
+    for (uint32_t i = 0; i < a->Length(); ++i) {
+        Local<Value> v = a->Get(ctx(), i).ToLocalChecked();
+        if (!v->IsArray()) {
+            Nan::ThrowError("Operation must be an array");
+            return;
+        }
+        Local<Array> op = Local<Array>::Cast(v);
+        Local<Value> arg1 = op->Get(ctx(), 1).ToLocalChecked();
+        Local<Value> arg2 = op->Get(ctx(), 2).ToLocalChecked();
+        String::Utf8Value k_str(isol(), op->Get(ctx(), 0).ToLocalChecked());
+        String::Utf8Value a_str(isol(), arg1);
+        String::Utf8Value b_str(isol(), arg2);
+        std::string kind = *k_str;
+
+        if ("set" == kind) {
+            ops.push_back(AugOp(AugOp::SET, *a_str,
+                                arg2->IsNull() ? "" : *b_str, std::string(),
+                                arg2->IsNull() ? AugOp::NULL_VALUE : 0));
+        } else if ("rm" == kind) {
+            ops.push_back(AugOp(AugOp::RM, *a_str));
+        } else if ("mv" == kind) {
+            ops.push_back(AugOp(AugOp::MV, *a_str, *b_str));
+        } else {
+            Nan::ThrowError(("Unknown operation: " + kind).c_str());
+            return;
+        }
+    }
 
-    if (info[0]->IsArray()) {
-        text = join(Local<Array>::Cast(info[0]));
-    } else {
-        String::Utf8Value t_str(isol(), info[0]);
-        text = *t_str;
+    {
+        AugLock lock(obj);
+        for (size_t i = 0; i < ops.size(); ++i) {
+            obj->touchOp(ops[i]);
+        }
     }
 
-    /*
-     * Returns the number of executed commands on success,
-     * -1 on failure, and -2 if a 'quit' command was encountered.
-     * TODO: use output (the second argument to aug_srun() != NULL)
-     */
-    int rc = aug_srun(obj->m_aug, NULL, text.c_str());
-    if (rc >= 0) {
-        info.GetReturnValue().Set(Nan::New<Number>(rc));
-    } else if (-1 == rc) {
-        throw_aug_error_msg(obj->m_aug);
-    } else if (-2 == rc) {
-        Nan::ThrowError("'quit' command was encountered");
-    } else {
-        Nan::ThrowError("Unexpected return code from aug_srun()");
+    WriteBatchUV *wuv = obj->m_batch;
+    if (NULL == wuv) {
+        wuv = obj->m_batch = new WriteBatchUV();
+        wuv->request.data = wuv;
+        wuv->applied = 0;
+        wuv->recorded = 0;
+        wuv->obj = obj;
+        wuv->aug = obj->m_aug;
+        wuv->handle.Reset(info.This());
     }
+    WriteCall call;
+    call.callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+    call.begin = wuv->ops.size();
+    wuv->ops.insert(wuv->ops.end(), ops.begin(), ops.end());
+    call.end = wuv->ops.size();
+    wuv->calls.push_back(call);
+
+    if (NULL == obj->m_running) {
+        obj->startWrites();
+    }
+}
 
-    Nan::Undefined();
+LibAugeas::LibAugeas()
+    : m_aug(NULL), m_id(0), m_flags(0), m_loaded(false), m_modified(false),
+      m_plain(true), m_journaling(false), m_lazy(false), m_primary(NULL),
+      m_readonly(false), m_back(NULL), m_busy(false), m_frontAt(0), m_backAt(0),
+      m_memory(0), m_caching(false), m_cacheBytes(0), m_hits(0),
+      m_misses(0), m_closed(false), m_inflight(0), m_batch(NULL),
+      m_running(NULL), m_copying(0) {
+    uv_mutex_init(&m_lock);
 }
 
-LibAugeas::LibAugeas() : m_aug(NULL) {}
+LibAugeas::~LibAugeas() {
+    detach();
+    adjustMemory(-m_memory);
+    aug_close(m_aug);
+    aug_close(m_back);
+    uv_mutex_destroy(&m_lock);
+}
 
-LibAugeas::~LibAugeas() { aug_close(m_aug); }
+/*
+ * Unlinks this handle from its primary and its replicas.
+ */
+void LibAugeas::detach() {
+    if (NULL != m_primary) {
+        std::vector<LibAugeas *> &r = m_primary->m_replicas;
+        r.erase(std::remove(r.begin(), r.end(), this), r.end());
+        m_primary->features();
+        m_primary = NULL;
+    }
+    for (size_t i = 0; i < m_replicas.size(); ++i) {
+        m_replicas[i]->m_primary = NULL;
+    }
+    m_replicas.clear();
+    features();
+}
 
-struct CreateAugeasUV {
-    uv_work_t request;
-    Nan::Callback callback;
+/*
+ * Options for creating augeas handle in async way.
+ */
+struct AugeasOptions {
     std::string root;
     std::string loadpath;
     std::string lens;
@@ -901,84 +5688,151 @@ struct CreateAugeasUV {
     std::string excl;
     std::string srun;
     unsigned int flags;
-    augeas *aug;
+    bool lazy;
+    LazyFiles lazyFiles; // enumerated files if lazy
+
+    AugeasOptions() : flags(0), lazy(false) {}
 };
 
 /*
+ * Reads extra options (lens, incl, excl, srun) from JS object.
+ */
+void read_options(Local<Object> obj, AugeasOptions &opts) {
+    opts.lazy = memberToBool(obj, "lazy");
+    opts.lens = memberToString(obj, "lens");
+    opts.incl = memberToString(obj, "incl");
+    opts.excl = memberToString(obj, "excl");
+
+    Local<Value> srun =
+        obj->Get(ctx(), Nan::New<String>("srun").ToLocalChecked()).ToLocalChecked();
+    if (srun->IsArray()) {
+        opts.srun = join(Local<Array>::Cast(srun));
+    } else {
+        opts.srun = memberToString(obj, "srun");
+    }
+}
+
+/*
+ * Creates augeas handle and loads files as specified by options.
+ * Called on the threadpool.
+ *
  * This function should immediately return if any call to augeas API fails.
  * The caller should check aug_error() before doing anything.
  */
-void createAugeasWork(uv_work_t *req) {
+augeas *open_augeas(AugeasOptions &opts) {
     int rc = AUG_NOERROR;
 
-    CreateAugeasUV *her = static_cast<CreateAugeasUV *>(req->data);
-
     // do not load all lenses if a specific lens is given,
     // ignore any setting in flags.
     // XXX: AUG_NO_MODL_AUTOLOAD implies AUG_NO_LOAD
-    if (!her->lens.empty()) {
-        her->flags |= AUG_NO_MODL_AUTOLOAD;
+    if (!opts.lens.empty()) {
+        opts.flags |= AUG_NO_MODL_AUTOLOAD;
     }
 
-    her->aug = aug_init(her->root.c_str(), her->loadpath.c_str(), her->flags);
-    rc = aug_error(her->aug);
+    // in lazy mode load files by lazy_load() instead of aug_init():
+    bool lazyInit = opts.lazy && opts.srun.empty() && opts.lens.empty() &&
+                    !(opts.flags & (AUG_NO_LOAD | AUG_NO_MODL_AUTOLOAD));
+
+    augeas *aug = aug_init(opts.root.c_str(), opts.loadpath.c_str(),
+                           lazyInit ? opts.flags | AUG_NO_LOAD : opts.flags);
+    rc = aug_error(aug);
     if (AUG_NOERROR != rc)
-        return;
+        return aug;
+
+    if (lazyInit) {
+        lazy_load(aug, opts.lazyFiles);
+        return aug;
+    }
 
     /*
      * Consider lens/incl/excl interface obsolete.
      * With srun: respect all flags (AUG_NO_MODL_AUTOLOAD, AUG_NO_LOAD),
      * execute srun commands and return.
      */
-    if (!her->srun.empty()) {
-        rc = aug_srun(her->aug, NULL, her->srun.c_str());
-        return;
+    if (!opts.srun.empty()) {
+        rc = aug_srun(aug, NULL, opts.srun.c_str());
+        return aug;
     }
 
-    if (!her->lens.empty()) {
+    if (!opts.lens.empty()) {
         // specifying which lens to load
         // /augeas/load/<random-name>/lens = e. g.: "hosts.lns" or
         // "@Hosts_Access"
         std::string basePath =
             "/augeas/load/1"; // "1" is a random valid name :-)
         std::string lensPath = basePath + "/lens";
-        std::string lensVal = her->lens;
+        std::string lensVal = opts.lens;
         if ((lensVal[0] != '@') // if not a module
             && (lensVal.rfind(".lns") == std::string::npos)) {
             lensVal += ".lns";
         }
-        rc = aug_set(her->aug, lensPath.c_str(), lensVal.c_str());
+        rc = aug_set(aug, lensPath.c_str(), lensVal.c_str());
         if (AUG_NOERROR != rc)
-            return;
+            return aug;
 
-        if (!her->incl.empty()) {
+        if (!opts.incl.empty()) {
             // specifying which files to load :
             // /augeas/load/<random-name>/incl = glob
             std::string inclPath = basePath + "/incl";
-            rc = aug_set(her->aug, inclPath.c_str(), her->incl.c_str());
+            rc = aug_set(aug, inclPath.c_str(), opts.incl.c_str());
             if (AUG_NOERROR != rc)
-                return;
+                return aug;
         }
-        if (!her->excl.empty()) {
+        if (!opts.excl.empty()) {
             // specifying which files NOT to load
             // /augeas/load/<random-name>/excl = glob (e. g. "*.dpkg-new")
             std::string exclPath = basePath + "/excl";
-            rc = aug_set(her->aug, exclPath.c_str(), her->excl.c_str());
+            rc = aug_set(aug, exclPath.c_str(), opts.excl.c_str());
             if (AUG_NOERROR != rc)
-                return;
+                return aug;
         }
 
-        rc = aug_load(her->aug);
+        rc = opts.lazy ? lazy_load(aug, opts.lazyFiles) : aug_load(aug);
         if (AUG_NOERROR != rc)
-            return;
+            return aug;
     }
+
+    return aug;
+}
+
+struct CreateAugeasUV {
+    uv_work_t request;
+    Nan::Callback callback;
+    AugeasOptions opts;
+    augeas *aug;
+    AsyncTimes times;
+};
+
+void createAugeasWork(uv_work_t *req) {
+    CreateAugeasUV *her = static_cast<CreateAugeasUV *>(req->data);
+    her->times.started = uv_hrtime();
+    her->aug = open_augeas(her->opts);
+    her->times.finished = uv_hrtime();
 }
 
 void createAugeasAfter(uv_work_t *req) {
     Nan::HandleScope scope;
 
     CreateAugeasUV *her = static_cast<CreateAugeasUV *>(req->data);
-    Local<Value> argv[] = { LibAugeas::New(her->aug) };
+    const AugeasOptions &opts = her->opts;
+    bool loaded = !opts.lens.empty() ||
+                  !(opts.flags & (AUG_NO_LOAD | AUG_NO_MODL_AUTOLOAD));
+    Local<Object> handle = LibAugeas::New(her->aug, opts.root, opts.loadpath,
+                                          opts.flags, loaded);
+    if (!opts.srun.empty()) {
+        node::ObjectWrap::Unwrap<LibAugeas>(handle)->record(
+            AugOp(AugOp::SRUN, opts.srun));
+    }
+    if (opts.lazy) {
+        node::ObjectWrap::Unwrap<LibAugeas>(handle)->lazy(her->opts.lazyFiles);
+    }
+    node::ObjectWrap::Unwrap<LibAugeas>(handle)->updateMemory();
+    if (tracing()) {
+        trace("createAugeas", node::ObjectWrap::Unwrap<LibAugeas>(handle)->id(),
+              opts.root, loaded_files(her->aug), her->times.queued,
+              her->times.started, her->times.finished);
+    }
+    Local<Value> argv[] = { handle };
 
     Nan::TryCatch try_catch;
     her->callback.Call(1, argv);
@@ -998,6 +5852,12 @@ void createAugeasAfter(uv_work_t *req) {
  *
  * var aug = augeas.createAugeas([...]) - sync
  *
+ * With option 'lazy: true' files matching incl globs are only enumerated
+ * when loading, and each file is parsed when a path under /files/<file>
+ * is used for the first time (see LazyFiles). Note that new files
+ * created in lazy mode are not saved unless they are loaded. Lazy mode is
+ * not applied to files loaded by 'srun' commands, and needs
+ * aug_load_file() (augeas 1.13.0).
  */
 NAN_METHOD(createAugeas) {
     Nan::HandleScope scope;
@@ -1006,6 +5866,7 @@ NAN_METHOD(createAugeas) {
     std::string root;
     std::string loadpath;
     unsigned int flags = 0;
+    bool lazy = false;
 
     // Allow passing options as an JS object:
     if (info[0]->IsObject()) {
@@ -1013,6 +5874,7 @@ NAN_METHOD(createAugeas) {
         root = memberToString(obj, "root");
         loadpath = memberToString(obj, "loadpath");
         flags = memberToUint32(obj, "flags");
+        lazy = memberToBool(obj, "lazy");
     } else {
         // C-like way:
         if (info[0]->IsString()) {
@@ -1043,24 +5905,13 @@ NAN_METHOD(createAugeas) {
         her->callback.SetFunction(
             Local<Function>::Cast(info[info.Length() - 1]));
 
-        her->root = root;
-        her->loadpath = loadpath;
-        her->flags = flags;
+        her->opts.root = root;
+        her->opts.loadpath = loadpath;
+        her->opts.flags = flags;
 
         // Extra options for async mode:
         if (info[0]->IsObject()) {
-            Local<Object> obj = info[0]->ToObject(ctx()).ToLocalChecked();
-            her->lens = memberToString(obj, "lens");
-            her->incl = memberToString(obj, "incl");
-            her->excl = memberToString(obj, "excl");
-
-            Local<Value> srun =
-                obj->Get(ctx(), Nan::New<String>("srun").ToLocalChecked()).ToLocalChecked();
-            if (srun->IsArray()) {
-                her->srun = join(Local<Array>::Cast(srun));
-            } else {
-                her->srun = memberToString(obj, "srun");
-            }
+            read_options(info[0]->ToObject(ctx()).ToLocalChecked(), her->opts);
         }
 
         uv_queue_work(uv_default_loop(), &her->request, createAugeasWork,
@@ -1069,28 +5920,375 @@ NAN_METHOD(createAugeas) {
         Nan::Undefined();
     } else { // sync
 
-        augeas *aug = aug_init(root.c_str(), loadpath.c_str(), flags);
+        // as OpSpan, but the handle is not known yet:
+        uint64_t start = tracing() ? uv_hrtime() : 0;
+        bool loaded = !(flags & (AUG_NO_LOAD | AUG_NO_MODL_AUTOLOAD));
+        augeas *aug = aug_init(root.c_str(), loadpath.c_str(),
+                               lazy ? flags | AUG_NO_LOAD : flags);
 
         if (NULL == aug) { // should not happen due to AUG_NO_ERR_CLOSE
             Nan::ThrowError("aug_init() badly failed: it should not return "
                             "NULL, but it did.");
-            Nan::Undefined();
+            return;
         } else if (AUG_NOERROR != aug_error(aug)) {
             throw_aug_error_msg(aug);
             aug_close(aug);
-            Nan::Undefined();
+            if (0 != start) {
+                trace("createAugeas", 0, root, -1, start, 0, uv_hrtime());
+            }
+            return;
+        }
+
+        LazyFiles lazyFiles;
+        if (lazy && loaded) {
+            lazy_load(aug, lazyFiles);
+        }
+
+        Local<Object> handle = LibAugeas::New(aug, root, loadpath, flags, loaded);
+        if (lazy) {
+            node::ObjectWrap::Unwrap<LibAugeas>(handle)->lazy(lazyFiles);
+        }
+        node::ObjectWrap::Unwrap<LibAugeas>(handle)->updateMemory();
+        if (0 != start) {
+            trace("createAugeas", node::ObjectWrap::Unwrap<LibAugeas>(handle)->id(),
+                  root, loaded_files(aug), start, 0, uv_hrtime());
+        }
+        info.GetReturnValue().Set(handle);
+    }
+}
+
+struct FanOut;
+
+struct FanOutTask {
+    uv_work_t request;
+    FanOut *fan;
+    AugeasOptions opts;
+    int rc;    // 0 on success, -1 on error
+    int saved; // number of saved files
+    std::string error;
+    AsyncTimes times;
+};
+
+struct FanOut {
+    Nan::Callback callback;
+    std::string script;      // commands to run after loading files
+    std::vector<AugOp> ops;  // journal to replay after script
+    std::vector<FanOutTask> tasks;
+    size_t next; // the first task not queued yet
+    size_t done;
+    uv_work_t request; // without roots, see fanOut()
+};
+
+/*
+ * Whole lifecycle of augeas handle for one root:
+ * create, load, run script, replay journal, save, close.
+ */
+void fanOutWork(uv_work_t *req) {
+    FanOutTask *task = static_cast<FanOutTask *>(req->data);
+    const FanOut *fan = task->fan;
+
+    task->times.started = uv_hrtime();
+    task->rc = -1;
+    task->saved = 0;
+
+    augeas *aug = open_augeas(task->opts);
+    if (NULL == aug) { // should not happen due to AUG_NO_ERR_CLOSE
+        task->error = "aug_init() failed";
+        return;
+    }
+
+    int rc = 0;
+    if (AUG_NOERROR == aug_error(aug) && !fan->script.empty()) {
+        rc = aug_srun(aug, NULL, fan->script.c_str());
+    }
+    if (AUG_NOERROR == aug_error(aug) && rc >= 0) {
+        size_t i = 0;
+        while (i < fan->ops.size() && apply_op(aug, fan->ops[i]) >= 0) {
+            ++i;
+        }
+        if (i == fan->ops.size() && AUG_NOERROR == aug_save(aug)) {
+            task->rc = 0;
+            task->saved = aug_match(aug, "/augeas/events/saved", NULL);
+        }
+    }
+
+    if (0 != task->rc) {
+        if (AUG_NOERROR != aug_error(aug)) {
+            task->error = aug_error_msg(aug);
+        } else if (-2 == rc) {
+            task->error = "'quit' command was encountered";
+        } else if (rc < 0) {
+            task->error = "Failed to run script";
+        } else {
+            task->error = "Failed to write files";
+        }
+    }
+    aug_close(aug);
+    task->times.finished = uv_hrtime();
+}
+
+void fanOutAfter(uv_work_t *req);
+
+void fanOutNext(FanOut *fan) {
+    if (fan->next < fan->tasks.size()) {
+        FanOutTask *task = &fan->tasks[fan->next++];
+        task->times.queued = uv_hrtime();
+        uv_queue_work(uv_default_loop(), &task->request, fanOutWork,
+                      (uv_after_work_cb)fanOutAfter);
+    }
+}
+
+/*
+ * Passes results to JS callback when all roots are done.
+ */
+void fanOutDone(FanOut *fan) {
+    Local<Array> results =
+        Nan::New<Array>(static_cast<int>(fan->tasks.size()));
+    for (size_t i = 0; i < fan->tasks.size(); ++i) {
+        const FanOutTask &t = fan->tasks[i];
+        Local<Object> res = Nan::New<Object>();
+        res->Set(ctx(), Nan::New<String>("root").ToLocalChecked(),
+                 Nan::New<String>(t.opts.root).ToLocalChecked());
+        res->Set(ctx(), Nan::New<String>("rc").ToLocalChecked(),
+                 Nan::New<Int32>(t.rc));
+        res->Set(ctx(), Nan::New<String>("saved").ToLocalChecked(),
+                 Nan::New<Int32>(t.saved));
+        if (0 != t.rc) {
+            res->Set(ctx(), Nan::New<String>("error").ToLocalChecked(),
+                     Nan::New<String>(t.error).ToLocalChecked());
+        }
+        results->Set(ctx(), i, res);
+    }
+
+    Local<Value> argv[] = { results };
+
+    Nan::TryCatch try_catch;
+    fan->callback.Call(1, argv);
+    delete fan;
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+}
+
+void fanOutAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    FanOutTask *task = static_cast<FanOutTask *>(req->data);
+    FanOut *fan = task->fan;
+
+    trace("fanOut", 0, task->opts.root, task->saved, task->times.queued,
+          task->times.started, task->times.finished);
+    ++fan->done;
+    fanOutNext(fan);
+    if (fan->done == fan->tasks.size()) {
+        fanOutDone(fan);
+    }
+}
+
+// Without roots nothing is done on the threadpool,
+// but the callback is still called asynchronously:
+void fanOutNoWork(uv_work_t *) {}
+
+void fanOutNoAfter(uv_work_t *req) {
+    Nan::HandleScope scope;
+
+    fanOutDone(static_cast<FanOut *>(req->data));
+}
+
+/*
+ * Applies the same changes to many root directories on the threadpool:
+ *
+ * augeas.fanOut(roots, options, function(results) {...})
+ *
+ * For every root an augeas handle is created and files are loaded
+ * as with async createAugeas() (options: loadpath, flags, lens, incl, excl,
+ * srun), then the following options are applied:
+ *
+ * script - augeas commands (string or array of strings) to run,
+ * journal - Buffer returned by journalStop() to replay,
+ *
+ * files are saved and the handle is closed. At most 'concurrency'
+ * (a positive number, default 4) roots are processed at the same time.
+ * Throws TypeError if options are not an object (or undefined),
+ * or concurrency is not a number, and RangeError if it is not positive.
+ *
+ * The callback gets an array of results in the order of roots:
+ * { root: '/srv/chroot1', rc: 0, saved: 2 } on success, or
+ * { root: '/srv/chroot2', rc: -1, saved: 0, error: '...' } on failure.
+ */
+NAN_METHOD(fanOut) {
+    Nan::HandleScope scope;
+
+    int last = info.Length() - 1;
+    if (info.Length() < 2 || info.Length() > 3 || !info[0]->IsArray() ||
+        !info[last]->IsFunction()) {
+        Nan::ThrowError("Function expects array of roots, optional options "
+                        "and callback");
+        return;
+    }
+    if (info.Length() == 3 && !info[1]->IsUndefined() &&
+        !info[1]->IsObject()) {
+        Nan::ThrowTypeError("Options must be an object");
+        return;
+    }
+
+    FanOut *fan = new FanOut();
+    fan->next = 0;
+    fan->done = 0;
+
+    AugeasOptions opts;
+    uint32_t concurrency = 4;
+
+    if (info.Length() == 3 && info[1]->IsObject()) {
+        Local<Object> obj = info[1]->ToObject(ctx()).ToLocalChecked();
+        opts.loadpath = memberToString(obj, "loadpath");
+        opts.flags = memberToUint32(obj, "flags");
+        read_options(obj, opts);
+
+        Local<Value> script =
+            obj->Get(ctx(), Nan::New<String>("script").ToLocalChecked()).ToLocalChecked();
+        if (script->IsArray()) {
+            fan->script = join(Local<Array>::Cast(script));
+        } else {
+            fan->script = memberToString(obj, "script");
+        }
+
+        Local<Value> journal =
+            obj->Get(ctx(), Nan::New<String>("journal").ToLocalChecked()).ToLocalChecked();
+        if (!journal->IsUndefined() &&
+            (!node::Buffer::HasInstance(journal) ||
+             !parse_ops(node::Buffer::Data(journal),
+                        node::Buffer::Length(journal), fan->ops))) {
+            delete fan;
+            Nan::ThrowError("Invalid journal");
+            return;
         }
 
-        info.GetReturnValue().Set(LibAugeas::New(aug));
+        Local<Value> n =
+            obj->Get(ctx(), Nan::New<String>("concurrency").ToLocalChecked()).ToLocalChecked();
+        if (!n->IsUndefined()) {
+            if (!n->IsNumber()) {
+                delete fan;
+                Nan::ThrowTypeError("concurrency must be a number");
+                return;
+            }
+            double c = n->NumberValue(ctx()).ToChecked();
+            if (!(c >= 1)) { // NaN too
+                delete fan;
+                Nan::ThrowRangeError("concurrency must be positive");
+                return;
+            }
+            concurrency = c < UINT32_MAX ? static_cast<uint32_t>(c)
+                                         : UINT32_MAX;
+        }
+    }
+
+    // always set to be able to get error messages, if aug_init() failed:
+    opts.flags |= AUG_NO_ERR_CLOSE;
+
+    Local<Array> roots = Local<Array>::Cast(info[0]);
+    fan->tasks.resize(roots->Length());
+    for (uint32_t i = 0; i < roots->Length(); ++i) {
+        FanOutTask &task = fan->tasks[i];
+        task.request.data = &task;
+        task.fan = fan;
+        task.opts = opts;
+        String::Utf8Value r_str(isol(), roots->Get(ctx(), i).ToLocalChecked());
+        task.opts.root = *r_str;
+    }
+    fan->callback.SetFunction(Local<Function>::Cast(info[last]));
+
+    if (fan->tasks.empty()) {
+        fan->request.data = fan;
+        uv_queue_work(uv_default_loop(), &fan->request, fanOutNoWork,
+                      (uv_after_work_cb)fanOutNoAfter);
+        return;
+    }
+
+    for (uint32_t i = 0; i < concurrency && i < fan->tasks.size(); ++i) {
+        fanOutNext(fan);
+    }
+}
+
+/*
+ * Sets a function receiving spans of augeas operations:
+ *
+ * augeas.setTracer(function(spans) {...})
+ *
+ * Spans are objects like
+ * { name: 'save', handle: 1, files: 2, start: 1234.5, duration: 12.3,
+ *   queue: 0.1, run: 12.2 }
+ * where 'handle' identifies augeas object (0 for fanOut()), 'path' is
+ * the path expression (if any), 'files' is the number of loaded or saved
+ * files (if known), 'start' is process.hrtime() in milliseconds,
+ * 'queue' and 'run' are given for operations on the threadpool.
+ * Spans are passed in batches once per event loop iteration.
+ * See also traceEvents() in index.js.
+ *
+ * setTracer(null) disables tracing. Buffered spans are passed
+ * to the previous function first. If called by the function itself,
+ * it is replaced when it returns. Spans buffered when the process exits
+ * are passed by flushTraces(), see index.js.
+ */
+NAN_METHOD(setTracer) {
+    Nan::HandleScope scope;
+
+    if (info.Length() != 1 || !(info[0]->IsFunction() || info[0]->IsNull())) {
+        Nan::ThrowError("Function expects a function or null");
+        return;
+    }
+
+    Nan::Callback *fn = NULL;
+    if (info[0]->IsFunction()) {
+        fn = new Nan::Callback(Local<Function>::Cast(info[0]));
+    }
+    // the tracer is running, see traceFlush():
+    if (traceFlushing) {
+        delete nextTracer;
+        nextTracer = fn;
+        traceReplace = true;
+        return;
+    }
+
+    // pass buffered spans to the old tracer:
+    traceFlush(&traceAsync);
+    delete tracer;
+    tracer = fn;
+}
+
+/*
+ * Passes buffered spans to the tracer right away. index.js calls it
+ * on process 'exit': the async handle passing spans does not keep
+ * the event loop alive, so the last ones would be dropped, and
+ * AtExit hooks run when JS cannot be called any more.
+ */
+NAN_METHOD(flushTraces) {
+    Nan::HandleScope scope;
+
+    if (!traceFlushing) {
+        traceFlush(&traceAsync);
     }
 }
 
 void init(Handle<Object> target) {
     LibAugeas::Init(target);
+    AugNodeset::Init(target);
+
+    uv_async_init(uv_default_loop(), &traceAsync, traceFlush);
+    uv_unref(reinterpret_cast<uv_handle_t *>(&traceAsync));
 
     target->Set(ctx(),
 		Nan::New<String>("createAugeas").ToLocalChecked(),
                 Nan::New<FunctionTemplate>(createAugeas)->GetFunction(ctx()).ToLocalChecked());
+    target->Set(ctx(),
+                Nan::New<String>("fanOut").ToLocalChecked(),
+                Nan::New<FunctionTemplate>(fanOut)->GetFunction(ctx()).ToLocalChecked());
+    target->Set(ctx(),
+                Nan::New<String>("setTracer").ToLocalChecked(),
+                Nan::New<FunctionTemplate>(setTracer)->GetFunction(ctx()).ToLocalChecked());
+    target->Set(ctx(),
+                Nan::New<String>("flushTraces").ToLocalChecked(),
+                Nan::New<FunctionTemplate>(flushTraces)->GetFunction(ctx()).ToLocalChecked());
 }
 
 NODE_MODULE(augeas, init)